@@ -0,0 +1,217 @@
+/* adcSpectrum.c */
+/* Spectral figures of merit of a raw ADC record (SNR, SINAD, SFDR, ENOB) */
+/* Author:  Gao    Create Date:  19Oct2026 */
+/* The last modified date:  19Oct2026 */
+
+/* The first spec_fft_len samples of a record, mean removed, are windowed with
+   a 4-term Blackman-Harris window and transformed by an in-place radix-2 FFT.
+   The one-sided power of bin k is P[k] = 2|X[k]|^2/S1^2, S1 the window sum,
+   so a full-scale sine peaks at 0 dBFS. Power sums over bins are divided by
+   the equivalent noise bandwidth of the window.
+
+   The fundamental is the largest bin above the DC lobe, harmonics 2-5 are
+   folded into the first Nyquist zone, each lobe is +-spec_lobe bins. Noise is
+   the mean of the remaining bins times the bins of the band, so the excluded
+   lobes are filled with it. The spur is the largest bin outside the DC and
+   fundamental lobes, harmonics included. ENOB is referred to full scale.
+
+   The work buffers are static, SpecAnalyze() is for one thread only. */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "adcSpectrum.h"
+#include "driverLog.h"
+
+#define spec_lobe 4	// main lobe half width of the window, bins
+#define spec_harmonics 5
+
+static float *window=NULL;
+static float *twiddle=NULL;	// cos and sin of 2*pi*k/n, k < n/2
+static float *work=NULL;	// n complex samples, re/im interleaved
+static float *power=NULL;	// n/2+1 bins
+static unsigned char *mask=NULL;
+static double windowSum=0;
+static double enbw=0;	// bins
+
+int SpecInit(void)
+{
+	unsigned int n = spec_fft_len, i;
+	double s2 = 0, a;
+	if(window != NULL)
+		return 0;
+	window = malloc(n * sizeof(float));
+	twiddle = malloc(n * sizeof(float));
+	work = malloc(2 * n * sizeof(float));
+	power = malloc((n/2 + 1) * sizeof(float));
+	mask = malloc(n/2 + 1);
+	if(window == NULL || twiddle == NULL || work == NULL || power == NULL || mask == NULL)
+	{
+		DrvLog(DRVLOG_ERROR, "Can't allocate the ADC spectrum buffers.\n");
+		free(window); free(twiddle); free(work); free(power); free(mask);
+		window = NULL;
+		return -1;
+	}
+	windowSum = 0;
+	for(i=0; i<n; i++)
+	{
+		a = 2 * M_PI * i / n;
+		window[i] = 0.35875 - 0.48829 * cos(a) + 0.14128 * cos(2 * a) - 0.01168 * cos(3 * a);
+		windowSum += window[i];
+		s2 += (double)window[i] * window[i];
+	}
+	enbw = n * s2 / (windowSum * windowSum);
+	for(i=0; i<n/2; i++)
+	{
+		twiddle[2*i] = cos(2 * M_PI * i / n);
+		twiddle[2*i+1] = -sin(2 * M_PI * i / n);
+	}
+	return 0;
+}
+
+static void Fft(float *x, unsigned int n)
+{
+	unsigned int i, j, k, len, half, step;
+	float tr, ti, ur, ui, wr, wi;
+	for(i=1, j=0; i<n; i++)	// bit reversal
+	{
+		k = n >> 1;
+		while(j & k)
+		{
+			j ^= k;
+			k >>= 1;
+		}
+		j |= k;
+		if(i < j)
+		{
+			tr = x[2*i]; x[2*i] = x[2*j]; x[2*j] = tr;
+			ti = x[2*i+1]; x[2*i+1] = x[2*j+1]; x[2*j+1] = ti;
+		}
+	}
+	for(len=2; len<=n; len<<=1)
+	{
+		half = len >> 1;
+		step = n / len;
+		for(i=0; i<n; i+=len)
+		{
+			for(j=0; j<half; j++)
+			{
+				wr = twiddle[2*j*step];
+				wi = twiddle[2*j*step+1];
+				ur = x[2*(i+j)];
+				ui = x[2*(i+j)+1];
+				tr = x[2*(i+j+half)] * wr - x[2*(i+j+half)+1] * wi;
+				ti = x[2*(i+j+half)] * wi + x[2*(i+j+half)+1] * wr;
+				x[2*(i+j)] = ur + tr;
+				x[2*(i+j)+1] = ui + ti;
+				x[2*(i+j+half)] = ur - tr;
+				x[2*(i+j+half)+1] = ui - ti;
+			}
+		}
+	}
+}
+
+static void MarkLobe(int center, int bins, unsigned char value)
+{
+	int k;
+	for(k=center-spec_lobe; k<=center+spec_lobe; k++)
+	{
+		if(k >= 0 && k < bins)
+			mask[k] = value;
+	}
+}
+
+static float DbFs(double p, double fullScale)
+{
+	return 10 * log10(fmax(p, 1E-30) / (fullScale * fullScale / 2));
+}
+
+/* sampleRate in MHz, fullScale in counts (amplitude of a full-scale sine).
+   spectrum[specLen] gets the peak dBFS of each group of bins. Returns -1 if
+   the record is shorter than spec_fft_len. */
+int SpecAnalyze(const float *data, unsigned int length, double sampleRate, double fullScale,
+	specResult_t *res, float *spectrum, unsigned int specLen)
+{
+	unsigned int n = spec_fft_len, i, group;
+	int bins = n/2 + 1, k, b, h, fund = spec_lobe + 1, spur = -1, noiseBins = 0, distBins = 0;
+	double mean = 0, norm, ps = 0, pn = 0, pd = 0, perBin, peak;
+	if(window == NULL || length < n)
+		return -1;
+	for(i=0; i<n; i++)
+		mean += data[i];
+	mean /= n;
+	for(i=0; i<n; i++)
+	{
+		work[2*i] = (data[i] - mean) * window[i];
+		work[2*i+1] = 0;
+	}
+	Fft(work, n);
+	norm = 2 / (windowSum * windowSum);
+	for(k=0; k<bins; k++)
+		power[k] = (work[2*k] * work[2*k] + work[2*k+1] * work[2*k+1]) * norm;
+
+	/* 0 noise, 1 DC, 2 fundamental, 3 harmonic */
+	memset(mask, 0, bins);
+	for(k=spec_lobe+1; k<bins; k++)
+	{
+		if(power[k] > power[fund])
+			fund = k;
+	}
+	for(h=2; h<=spec_harmonics; h++)
+	{
+		b = (int)(((long long)h * fund) % n);
+		if(b > (int)n/2)
+			b = n - b;
+		MarkLobe(b, bins, 3);
+	}
+	MarkLobe(fund, bins, 2);
+	MarkLobe(0, bins, 1);
+	for(k=0; k<bins; k++)
+	{
+		if(mask[k] == 2)
+			ps += power[k];
+		else if(mask[k] == 3)
+		{
+			pd += power[k];
+			distBins++;
+		}
+		else if(mask[k] == 0)
+		{
+			pn += power[k];
+			noiseBins++;
+		}
+		if(mask[k] != 1 && mask[k] != 2 && (spur < 0 || power[k] > power[spur]))
+			spur = k;
+	}
+	if(noiseBins == 0)
+		return -1;
+	perBin = pn / noiseBins;
+	res->noiseFloor = DbFs(perBin, fullScale);
+	ps /= enbw;
+	pn = perBin * (bins - 1 - spec_lobe) / enbw;	// whole band but DC
+	pd = fmax(pd - perBin * distBins, 0) / enbw;	// less the noise under the harmonics
+	res->signal = DbFs(ps, fullScale);
+	res->snr = 10 * log10(fmax(ps, 1E-30) / fmax(pn, 1E-30));
+	res->sinad = 10 * log10(fmax(ps, 1E-30) / fmax(pn + pd, 1E-30));
+	res->enob = (res->sinad - 1.76 - res->signal) / 6.02;
+	res->sfdr = (spur >= 0) ? 10 * log10(fmax(power[fund], 1E-30) / fmax(power[spur], 1E-30)) : 0;
+	res->fundFreq = fund * sampleRate / n;
+	res->spurFreq = (spur >= 0) ? spur * sampleRate / n : 0;
+
+	if(specLen > 0)
+	{
+		group = (bins - 1) / specLen;
+		if(group < 1)
+			group = 1;
+		for(i=0; i<specLen; i++)
+		{
+			peak = 0;
+			for(k=i*group; k<(int)((i+1)*group) && k<bins; k++)
+				peak = fmax(peak, power[k]);
+			spectrum[i] = DbFs(peak, fullScale);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,27 @@
+/* adcSpectrum.h */
+/* Author:  Gao    Create Date:  19Oct2026 */
+/* The last modified date:  19Oct2026 */
+
+#ifndef _adcSpectrum_H
+#define _adcSpectrum_H
+
+#define spec_fft_len 32768
+
+typedef struct {
+	float signal;	// dBFS
+	float snr;	// dB
+	float sinad;	// dB
+	float sfdr;	// dBc
+	float enob;	// bits
+	float noiseFloor;	// dBFS per bin
+	float fundFreq;	// MHz
+	float spurFreq;	// MHz
+}specResult_t;
+
+/* The following functions will be called from driver layer.**************/
+int SpecInit(void);
+
+int SpecAnalyze(const float *data, unsigned int length, double sampleRate, double fullScale,
+	specResult_t *res, float *spectrum, unsigned int specLen);
+
+#endif
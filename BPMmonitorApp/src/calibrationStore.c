@@ -0,0 +1,449 @@
+/* calibrationStore.c */
+/* Calibration parameters of the power conversion (llrfparameters.csv) */
+/* Author:  Gao    Create Date:  19Oct2026 */
+/* The last modified date:  19Oct2026 */
+
+/* The CSV file is watched with inotify and parsed on the store's own thread.
+   A parsed table is validated, then published by swapping one pointer under
+   storeLock; a published table is never modified. Readers copy the values they
+   need under the same lock, so they always see one complete table and a slow
+   file never holds up a scan thread. Columns 1 and 5 of the file are not
+   used, as with the old fixed parser: the power offset of a channel (column 1)
+   only comes from SetReg(8), it is kept apart from the table. */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#include "calibrationStore.h"
+#include "driverLog.h"
+
+#define cal_line_len 1024
+#define log_line_len 96
+
+typedef struct {
+	int rows;
+	int columns;
+	double *data;	// rows*columns, row major
+}calTable_t;
+
+static pthread_mutex_t storeLock = PTHREAD_MUTEX_INITIALIZER;
+static calTable_t *current = NULL;
+static unsigned int tableVersion = 0;
+static unsigned int loadErrors = 0;
+static double offsets[cal_max_rows];
+static unsigned char offsetSet[cal_max_rows];
+
+static char calPath[256] = "";
+static int wakeFd[2] = {-1, -1};
+
+static void *CalStoreThread(void *arg);
+static int LoadCalFile(void);
+static calTable_t *ParseCalFile(const char *path, char *err, size_t errLen);
+static int ParseField(char *field, double *value);
+static void PublishTable(calTable_t *table);
+static void FreeTable(calTable_t *table);
+
+int CalStoreInit(const char *path)
+{
+	pthread_t tid;
+	if(path != NULL)
+		CalStoreSetPath(path);
+	if(pipe(wakeFd) != 0)
+	{
+		DrvLog(DRVLOG_ERROR, "Calibration store: failed to create wake pipe, %s\n", strerror(errno));
+		return -1;
+	}
+	fcntl(wakeFd[0], F_SETFL, O_NONBLOCK);
+	fcntl(wakeFd[1], F_SETFL, O_NONBLOCK);
+	if(pthread_create(&tid, NULL, CalStoreThread, NULL) != 0)
+	{
+		DrvLog(DRVLOG_ERROR, "Calibration store: create thread error!\n");
+		return -1;
+	}
+	return 0;
+}
+
+void CalStoreSetPath(const char *path)
+{
+	snprintf(calPath, sizeof(calPath), "%s", path);
+}
+
+/* Ask the store thread to reload the file. Never blocks the caller. */
+void CalStoreRequestReload(void)
+{
+	char c = 1;
+	if(wakeFd[1] >= 0 && write(wakeFd[1], &c, 1) < 0 && errno != EAGAIN)
+		DrvLog(DRVLOG_WARN, "Calibration store: reload request lost, %s\n", strerror(errno));
+}
+
+int CalStoreGet(int row, int column, double *data)
+{
+	int status = 0;
+	pthread_mutex_lock(&storeLock);
+	if(column == 1 && row >= 0 && row < cal_max_rows && offsetSet[row])
+		*data = offsets[row];
+	else if(current != NULL && row >= 0 && row < current->rows && column >= 0 && column < current->columns)
+		*data = current->data[row*current->columns + column];
+	else
+	{
+		*data = 0;
+		status = -1;
+	}
+	pthread_mutex_unlock(&storeLock);
+	return status;
+}
+
+/* Offset and the two fit coefficients of one channel, taken from the same table. */
+int CalStoreGetPower(int row, double *offset, double *a, double *b)
+{
+	int status = 0;
+	pthread_mutex_lock(&storeLock);
+	if(current != NULL && row >= 0 && row < current->rows)
+	{
+		*offset = current->data[row*current->columns + 1];
+		*a = current->data[row*current->columns + 2];
+		*b = current->data[row*current->columns + 3];
+	}else{
+		*offset = *a = *b = 0;
+		status = -1;
+	}
+	if(row >= 0 && row < cal_max_rows && offsetSet[row])
+		*offset = offsets[row];
+	pthread_mutex_unlock(&storeLock);
+	return status;
+}
+
+void CalStoreSetOffset(int row, double value)
+{
+	if(row < 0 || row >= cal_max_rows)
+		return;
+	pthread_mutex_lock(&storeLock);
+	offsets[row] = value;
+	offsetSet[row] = 1;
+	pthread_mutex_unlock(&storeLock);
+}
+
+unsigned int CalStoreVersion(void)
+{
+	unsigned int version;
+	pthread_mutex_lock(&storeLock);
+	version = tableVersion;
+	pthread_mutex_unlock(&storeLock);
+	return version;
+}
+
+int CalStoreRows(void)
+{
+	int rows;
+	pthread_mutex_lock(&storeLock);
+	rows = (current != NULL) ? current->rows : 0;
+	pthread_mutex_unlock(&storeLock);
+	return rows;
+}
+
+unsigned int CalStoreLoadErrors(void)
+{
+	return loadErrors;
+}
+
+/* Copy the file values of the current table, for the setpoint snapshot. */
+int CalStoreExport(double *data, int maxLen, int *rows, int *columns)
+{
+	int status = -1;
+	pthread_mutex_lock(&storeLock);
+	*rows = *columns = 0;
+	if(current != NULL && current->rows*current->columns <= maxLen)
+	{
+		memcpy(data, current->data, current->rows*current->columns*sizeof(double));
+		*rows = current->rows;
+		*columns = current->columns;
+		status = 0;
+	}
+	pthread_mutex_unlock(&storeLock);
+	return status;
+}
+
+/* Publish a table restored from the snapshot. A table loaded from the file
+   always wins, so this is ignored once the file has been read. */
+int CalStoreImport(const double *data, int rows, int columns)
+{
+	calTable_t *table;
+	if(rows <= 0 || rows > cal_max_rows || columns < 4 || columns > cal_max_columns)
+		return -1;
+	table = calloc(1, sizeof(calTable_t));
+	if(table == NULL)
+		return -1;
+	table->data = malloc(rows*columns*sizeof(double));
+	if(table->data == NULL)
+	{
+		free(table);
+		return -1;
+	}
+	table->rows = rows;
+	table->columns = columns;
+	memcpy(table->data, data, rows*columns*sizeof(double));
+	pthread_mutex_lock(&storeLock);
+	if(current != NULL)
+	{
+		pthread_mutex_unlock(&storeLock);
+		FreeTable(table);
+		return -1;
+	}
+	current = table;
+	tableVersion++;
+	pthread_mutex_unlock(&storeLock);
+	return 0;
+}
+
+static void *CalStoreThread(void *arg)
+{
+	struct pollfd fds[2];
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char dir[256], *base, *slash;
+	const struct inotify_event *event;
+	int inotifyFd, nfds = 1, reload;
+	ssize_t len, i;
+
+	snprintf(dir, sizeof(dir), "%s", calPath);
+	slash = strrchr(dir, '/');
+	if(slash == dir)
+		slash[1] = '\0';
+	else if(slash != NULL)
+		*slash = '\0';
+	else
+		snprintf(dir, sizeof(dir), ".");
+	base = strrchr(calPath, '/');
+	base = (base != NULL) ? base + 1 : calPath;
+
+	/* Watch the directory, editors and scp often replace the file by a rename. */
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(inotifyFd >= 0 && inotify_add_watch(inotifyFd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) >= 0)
+	{
+		fds[1].fd = inotifyFd;
+		fds[1].events = POLLIN;
+		nfds = 2;
+	}else{
+		DrvLog(DRVLOG_WARN, "Calibration store: cannot watch %s (%s), reload only on request.\n", dir, strerror(errno));
+	}
+	fds[0].fd = wakeFd[0];
+	fds[0].events = POLLIN;
+
+	LoadCalFile();
+	while(1)
+	{
+		if(poll(fds, nfds, -1) <= 0)
+			continue;
+		reload = 0;
+		if(fds[0].revents & POLLIN)
+		{
+			while(read(wakeFd[0], buffer, sizeof(buffer)) > 0)
+				;
+			reload = 1;
+		}
+		if(nfds == 2 && (fds[1].revents & POLLIN))
+		{
+			while((len = read(inotifyFd, buffer, sizeof(buffer))) > 0)
+			{
+				i = 0;
+				while(i < len)
+				{
+					event = (const struct inotify_event *)&buffer[i];
+					if(event->len > 0 && strcmp(event->name, base) == 0)
+						reload = 1;
+					i += sizeof(struct inotify_event) + event->len;
+				}
+			}
+		}
+		if(reload)
+			LoadCalFile();
+	}
+	return NULL;
+}
+
+static int LoadCalFile(void)
+{
+	calTable_t *table;
+	char err[128];
+	char line[log_line_len];
+	int i, j, len;
+
+	table = ParseCalFile(calPath, err, sizeof(err));
+	if(table == NULL)
+	{
+		loadErrors++;
+		DrvLog(DRVLOG_ERROR, "Calibration store: %s not loaded, %s. Keep version %u.\n", calPath, err, CalStoreVersion());
+		return -1;
+	}
+	PublishTable(table);
+	DrvLog(DRVLOG_INFO, "Calibration store: loaded %s, %d rows x %d columns, version %u\n", calPath, table->rows, table->columns, CalStoreVersion());
+	if(!DrvLogEnabled(DRVLOG_DEBUG))
+		return 0;
+	for(i=0; i<table->rows; i++)
+	{
+		len = 0;
+		for(j=0; j<table->columns && len<(int)sizeof(line); j++)
+			len += snprintf(&line[len], sizeof(line)-len, "%e\t", table->data[i*table->columns + j]);
+		DrvLog(DRVLOG_DEBUG, "%s\n", line);
+	}
+	return 0;
+}
+
+/* Every row must have the same number of numeric columns (at least the offset
+   and the two fit coefficients). The first row may be a text header, it is
+   kept as a row of zeros so the row number still equals the channel number.
+   Blank lines are only allowed at the end of the file. */
+static calTable_t *ParseCalFile(const char *path, char *err, size_t errLen)
+{
+	FILE *fp;
+	char line[cal_line_len];
+	char *field, *next;
+	double row[cal_max_columns];
+	double *data;
+	int rows = 0, columns = 0, n, blank = 0, header;
+	calTable_t *table;
+
+	fp = fopen(path, "r");
+	if(fp == NULL)
+	{
+		snprintf(err, errLen, "%s", strerror(errno));
+		return NULL;
+	}
+	data = malloc(cal_max_rows*cal_max_columns*sizeof(double));
+	if(data == NULL)
+	{
+		fclose(fp);
+		snprintf(err, errLen, "out of memory");
+		return NULL;
+	}
+	while(fgets(line, sizeof(line), fp) != NULL)
+	{
+		if(strchr(line, '\n') == NULL && !feof(fp))
+		{
+			snprintf(err, errLen, "line %d is too long", rows+1);
+			goto fail;
+		}
+		line[strcspn(line, "\r\n")] = '\0';
+		if(line[strspn(line, " \t")] == '\0')
+		{
+			blank = 1;
+			continue;
+		}
+		if(blank)
+		{
+			snprintf(err, errLen, "blank line before row %d", rows+1);
+			goto fail;
+		}
+		if(rows >= cal_max_rows)
+		{
+			snprintf(err, errLen, "more than %d rows", cal_max_rows);
+			goto fail;
+		}
+		n = 0;
+		header = 0;
+		for(field=line; field!=NULL; field=next)
+		{
+			next = strchr(field, ',');
+			if(next != NULL)
+				*next++ = '\0';
+			if(n >= cal_max_columns)
+			{
+				snprintf(err, errLen, "row %d has more than %d columns", rows+1, cal_max_columns);
+				goto fail;
+			}
+			if(ParseField(field, &row[n]) != 0)
+			{
+				if(rows != 0)
+				{
+					snprintf(err, errLen, "row %d column %d is not a number", rows+1, n+1);
+					goto fail;
+				}
+				header = 1;
+			}
+			n++;
+		}
+		if(header)
+			memset(row, 0, sizeof(row));
+		else if(columns == 0)
+			columns = n;
+		else if(n != columns)
+		{
+			snprintf(err, errLen, "row %d has %d columns, expected %d", rows+1, n, columns);
+			goto fail;
+		}
+		row[1] = 0;	// the offset, see CalStoreSetOffset()
+		if(n > 5)
+			row[5] = 0;
+		memcpy(&data[rows*cal_max_columns], row, cal_max_columns*sizeof(double));
+		rows++;
+	}
+	fclose(fp);
+	fp = NULL;
+	if(columns < 4)
+	{
+		snprintf(err, errLen, "%d columns, need at least 4", columns);
+		goto fail;
+	}
+
+	table = calloc(1, sizeof(calTable_t));
+	if(table == NULL)
+		goto fail;
+	table->data = malloc(rows*columns*sizeof(double));
+	if(table->data == NULL)
+	{
+		free(table);
+		goto fail;
+	}
+	table->rows = rows;
+	table->columns = columns;
+	for(n=0; n<rows; n++)
+		memcpy(&table->data[n*columns], &data[n*cal_max_columns], columns*sizeof(double));
+	free(data);
+	return table;
+
+fail:
+	if(fp != NULL)
+		fclose(fp);
+	free(data);
+	return NULL;
+}
+
+static int ParseField(char *field, double *value)
+{
+	char *end;
+	field += strspn(field, " \t");
+	if(*field == '\0')
+		return -1;
+	*value = strtod(field, &end);
+	end += strspn(end, " \t");
+	if(*end != '\0' || !isfinite(*value))
+		return -1;
+	return 0;
+}
+
+static void PublishTable(calTable_t *table)
+{
+	calTable_t *old;
+	pthread_mutex_lock(&storeLock);
+	old = current;
+	current = table;
+	tableVersion++;
+	pthread_mutex_unlock(&storeLock);
+	FreeTable(old);
+}
+
+static void FreeTable(calTable_t *table)
+{
+	if(table == NULL)
+		return;
+	free(table->data);
+	free(table);
+}
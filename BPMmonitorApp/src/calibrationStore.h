@@ -0,0 +1,34 @@
+/* calibrationStore.h */
+/* Author:  Gao    Create Date:  19Oct2026 */
+/* The last modified date:  19Oct2026 */
+
+#ifndef _calibrationStore_H
+#define _calibrationStore_H
+
+#define cal_max_rows 256
+#define cal_max_columns 32
+
+/* The following functions will be called from driver layer.**************/
+int CalStoreInit(const char *path);
+
+void CalStoreSetPath(const char *path);
+
+void CalStoreRequestReload(void);
+
+int CalStoreGet(int row, int column, double *data);
+
+int CalStoreGetPower(int row, double *offset, double *a, double *b);
+
+void CalStoreSetOffset(int row, double value);
+
+unsigned int CalStoreVersion(void);
+
+int CalStoreRows(void);
+
+unsigned int CalStoreLoadErrors(void);
+
+int CalStoreExport(double *data, int maxLen, int *rows, int *columns);
+
+int CalStoreImport(const double *data, int rows, int columns);
+
+#endif
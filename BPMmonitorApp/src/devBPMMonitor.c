@@ -1,13 +1,14 @@
 /* devBPMMonitor.c */
 /* Device support module */
 /* Author:  Gao    Create Date:  02Nov2021 */
-/* The last modified date:  23Dec2021 */
+/* The last modified date:  19Oct2026 */
   
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#include <alarm.h>
 #include <dbAccess.h>
 #include <recGbl.h>
 #include <devSup.h>
@@ -15,7 +16,10 @@
 #include <cantProceed.h>
 #include <epicsExport.h>
 #include <epicsMath.h>
+#include <epicsMutex.h>
 #include <epicsTypes.h>
+#include <menuFtype.h>
+#include <ellLib.h>
 
 #include <aiRecord.h>
 #include <aoRecord.h>
@@ -40,6 +44,9 @@ typedef struct {
 	strtype_t type;
 	unsigned short offset;
 	unsigned short channel;
+	void *ownBuf;	/* waveform: the buffer the record allocated */
+	float *frameBuf;	/* waveform: driver frame buffer BPTR points at, or NULL */
+	unsigned char ownDisp;	/* waveform: DISP while BPTR is ownBuf */
 }recordpara_t;
 
 /* ai ***************************************************************/
@@ -60,7 +67,7 @@ struct {
     NULL,
     NULL,
     init_record_ai,
-    NULL,
+    devGetInScalarInfo,
     read_ai,
     NULL
 };
@@ -108,7 +115,7 @@ struct {
     NULL,
     NULL,
     init_record_bi,
-    NULL,
+    devGetInScalarInfo,
     read_bi,
     NULL
 };
@@ -206,6 +213,29 @@ struct {
 };
 epicsExportAddress(dset, devADCRawDataWaveform);
 
+/* Packed trigger frame waveform ***************************************************************/
+static long read_frame(waveformRecord *);
+
+struct {
+    long      number;
+    DEVSUPFUN report;
+    DEVSUPFUN init;
+    DEVSUPFUN init_record;
+    DEVSUPFUN get_ioint_info;
+    DEVSUPFUN read;
+    DEVSUPFUN special_linconv;
+} devFrameWaveform =
+{
+    6,
+    NULL,
+    NULL,
+    init_record_wf,
+    devGetInTrigInfo,
+    read_frame,
+    NULL
+};
+epicsExportAddress(dset, devFrameWaveform);
+
 /***********************************************************************
  *   Routine to parse IO arguments
  **********************************************************************/ 
@@ -269,11 +299,81 @@ static int devIoParse(char *string, recordpara_t *recordpara)
  }
 
 /*********  Support for "I/O Intr" for input records ******************/ 
+/* The I/O Intr trigger waveforms are kept in trigRecords[] so that the
+   monitors on them can be counted for demand-driven scanning. get_ioint_info
+   keeps the list and the records per offset under trigLock; ReportDemand(),
+   called by the driver outside the acquisition thread, copies the list and
+   counts the monitors of each record under its scan lock. */
+#define trig_record_max 256
+
+static epicsMutexId trigLock = NULL;
+static dbCommon *trigRecords[trig_record_max];
+static int trigRecordNum = 0;
+static int trigOffsetMax = -1;
+static int trigOffsetRecords[trig_record_max];
+
+static void ReportDemand(void)
+{
+	static dbCommon *list[trig_record_max];
+	static int records[trig_record_max], monitors[trig_record_max];
+	recordpara_t *p;
+	int i, n, last;
+	epicsMutexMustLock(trigLock);
+	n = trigRecordNum;
+	memcpy(list, trigRecords, n * sizeof(dbCommon *));
+	memcpy(records, trigOffsetRecords, sizeof(records));
+	last = trigOffsetMax;
+	epicsMutexUnlock(trigLock);
+	memset(monitors, 0, sizeof(monitors));
+	for(i=0; i<n; i++)
+	{
+		p = list[i]->dpvt;
+		if(p->offset >= trig_record_max)
+			continue;
+		dbScanLock(list[i]);
+		monitors[p->offset] += ellCount(&list[i]->mlis);
+		dbScanUnlock(list[i]);
+	}
+	for(i=0; i<=last; i++)
+		SetWaveformDemand(i, records[i], monitors[i]);
+}
+
 static long devGetInTrigInfo(int cmd, dbCommon * record,
 				  IOSCANPVT * ppvt) 
 {
-//	recordpara_t * p = record->dpvt;
-	*ppvt = devGetInTrigScanPvt();
+	recordpara_t * p = record->dpvt;
+	int i, counted = (p->offset >= 0 && p->offset < trig_record_max);
+	*ppvt = devGetInTrigChannelScanPvt(p->offset);
+	epicsMutexMustLock(trigLock);
+	for(i=0; i<trigRecordNum && trigRecords[i] != record; i++)
+		;
+	if(cmd == 0 && i == trigRecordNum && trigRecordNum < trig_record_max)
+	{
+		trigRecords[trigRecordNum++] = record;
+		if(counted)
+		{
+			trigOffsetRecords[p->offset]++;
+			if(p->offset > trigOffsetMax)
+				trigOffsetMax = p->offset;
+		}
+		SetDemandHook(ReportDemand);
+	}
+	else if(cmd == 1 && i < trigRecordNum)
+	{
+		trigRecords[i] = trigRecords[--trigRecordNum];
+		if(counted)
+			trigOffsetRecords[p->offset]--;
+	}
+	epicsMutexUnlock(trigLock);
+	return 0;
+}
+
+/*********  Support for "I/O Intr" for per-pulse scalars ******************/ 
+static long devGetInScalarInfo(int cmd, dbCommon * record,
+				  IOSCANPVT * ppvt) 
+{
+	recordpara_t * p = record->dpvt;
+	*ppvt = devGetInScalarChannelScanPvt(p->offset);
 	return 0;
 }
 
@@ -334,6 +434,8 @@ static long read_ai(aiRecord *record)
 	}
 	record->val = value;	
 	record->udf = FALSE;
+	if(record->tse == epicsTimeEventDeviceTime)
+		GetFrameTime(&record->time);
 	return 2;
 }
 
@@ -341,9 +443,13 @@ static long read_ai(aiRecord *record)
 static long init_record_ao(aoRecord *record) 
 {
 	recordpara_t *priv;
+	float restored;
 	priv = (recordpara_t *)callocMustSucceed(1, sizeof(recordpara_t),"init_record_ao");
 	devIoParse(record->out.value.instio.string, priv);
 	record->dpvt = priv;
+	/* Setpoint restored from the driver snapshot wins over the db default. */
+	if(GetRestoredReg(priv->offset, priv->channel, &restored) == 0)
+		record->val = restored;
 	return 2;		/* preserve whatever is in the VAL field */
 }
 
@@ -374,6 +480,9 @@ static long read_bi(biRecord *record)
 //	record->udf = FALSE;
 //	return 2;
 	record->rval = (int)value;
+	if(record->tse == epicsTimeEventDeviceTime
+		&& GetStatusTime(priv->offset, priv->channel, &record->time) != 0)
+		GetFrameTime(&record->time);
 	return 0;
 }
 
@@ -381,9 +490,13 @@ static long read_bi(biRecord *record)
 static long init_record_bo(boRecord *record) 
 {
 	recordpara_t *priv;
+	float restored;
 	priv = (recordpara_t *)callocMustSucceed(1, sizeof(recordpara_t),"init_record_ao");
 	devIoParse(record->out.value.instio.string, priv);
 	record->dpvt = priv;
+	/* Setpoint restored from the driver snapshot wins over the db default. */
+	if(GetRestoredReg(priv->offset, priv->channel, &restored) == 0)
+		record->val = (restored != 0);
 	return 2;		/* preserve whatever is in the VAL field */
 }
 
@@ -405,20 +518,93 @@ static long init_record_wf(waveformRecord *record)
 	devIoParse(record->inp.value.instio.string, priv);
 /* 	printf("recordpara->type:%d\n", priv->type);
 	printf("recordpara->offset:%d\n", priv->offset); */
+	priv->ownBuf = record->bptr;
 	record->dpvt = priv;
+	if(trigLock == NULL)
+		trigLock = epicsMutexMustCreate();
 	return 0;
 }
 
+/* With zero-copy on the driver hands out a reference to the frame buffer of
+   the channel and BPTR is swapped to it, the reference to the previous one is
+   dropped. The record is locked while it processes, so CA reads the buffer
+   BPTR points at. A buffer shorter than NELM is not used, a put could run
+   past its end. While BPTR points at a shared buffer DISP is set, so no put
+   writes into it; it goes back to its own value with the record's buffer. A SHORT or LONG record gets the counts of the channel, see
+   the CountSlope/CountOffset records for their scale. */
 static long read_wf(waveformRecord *record)
 {
 	long long TaiSec = 0;
 	int TaiNSec = 0;
+	unsigned int length = 0;
+	int clipped;
+	float *frame = NULL;
 	recordpara_t *priv = (recordpara_t *)record->dpvt;
-	readWaveform(priv->offset, priv->channel, record->nelm, record->bptr, &TaiSec, &TaiNSec);
+	if(record->ftvl == menuFtypeSHORT || record->ftvl == menuFtypeLONG)
+	{
+		clipped = readWaveformCounts(priv->offset, priv->channel, record->nelm, record->bptr,
+			(record->ftvl == menuFtypeSHORT) ? 2 : 4, &TaiSec, &TaiNSec);
+		if(clipped < 0)
+		{
+			record->nord = 0;
+			recGblSetSevr(record, READ_ALARM, INVALID_ALARM);
+			return -1;
+		}
+		if(clipped > 0)
+			recGblSetSevr(record, HW_LIMIT_ALARM, MINOR_ALARM);
+	}
+	else
+	{
+		if(record->ftvl == menuFtypeFLOAT)
+			frame = AcquireWaveform(priv->offset, priv->channel, &length, &TaiSec, &TaiNSec);
+		if(frame != NULL && length >= record->nelm)
+		{
+			if(priv->frameBuf == NULL)
+			{
+				priv->ownDisp = record->disp;
+				record->disp = 1;
+			}
+			ReleaseWaveform(priv->frameBuf);
+			priv->frameBuf = frame;
+			record->bptr = frame;
+		}
+		else
+		{
+			ReleaseWaveform(frame);
+			if(priv->frameBuf != NULL)
+			{
+				record->bptr = priv->ownBuf;
+				record->disp = priv->ownDisp;
+				ReleaseWaveform(priv->frameBuf);
+				priv->frameBuf = NULL;
+			}
+			readWaveform(priv->offset, priv->channel, record->nelm, record->bptr, &TaiSec, &TaiNSec);
+		}
+	}
 	record->time.secPastEpoch=(epicsUInt32)TaiSec;
 	record->time.nsec=(epicsUInt32)TaiNSec;
 /* 	printf("recordpara->type:%d\n", priv->type);
 	printf("recordpara->offset:%d\n", priv->offset); */
 	record->nord = record->nelm;
 	return 0;
-}
\ No newline at end of file
+}
+
+static long read_frame(waveformRecord *record)
+{
+	unsigned int nBytes = 0;
+	int status;
+	if(record->ftvl != menuFtypeUCHAR && record->ftvl != menuFtypeCHAR)
+	{
+		recGblSetSevr(record, READ_ALARM, INVALID_ALARM);
+		return -1;
+	}
+	status = readFrameWaveform(record->bptr, record->nelm, &nBytes, &record->time);
+	if(status < 0)
+	{
+		record->nord = 0;
+		recGblSetSevr(record, READ_ALARM, INVALID_ALARM);
+		return -1;
+	}
+	record->nord = nBytes;
+	return 0;
+}
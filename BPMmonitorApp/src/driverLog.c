@@ -0,0 +1,406 @@
+/* driverLog.c */
+/* Asynchronous log of the driver */
+/* Author:  Gao    Create Date:  19Oct2026 */
+/* The last modified date:  19Oct2026 */
+
+/* DrvLog() only stores the format pointer, the raw arguments and a monotonic
+   timestamp into a lock-free ring (bounded MPMC queue, one sequence number per
+   slot), so a scan thread never formats text or touches the console. The log
+   thread formats the entries and writes them to the console or to a file.
+   Every format string may print at most rateLimit lines per second, the rest
+   is counted and reported with the next line that gets through. */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "driverLog.h"
+
+#define log_ring_len 1024	// power of 2
+#define log_max_args 6
+#define log_text_len 96
+#define log_rate_slots 64
+
+typedef union {
+	long long i;
+	double d;
+	int s;	// offset of the copied string in text[]
+}logArg_t;
+
+typedef struct {
+	unsigned long seq;
+	const char *fmt;
+	int level;
+	int nargs;
+	struct timespec ts;
+	logArg_t args[log_max_args];
+	char text[log_text_len];
+}logEntry_t;
+
+typedef struct {
+	const char *fmt;
+	time_t window;
+	int count;
+	int suppressed;
+}logRate_t;
+
+static logEntry_t ring[log_ring_len];
+static unsigned long enqueuePos = 0;
+static unsigned long dequeuePos = 0;
+static int logLevel = DRVLOG_INFO;
+static int rateLimit = 10;
+static unsigned int dropped = 0;
+static unsigned int suppressedTotal = 0;
+static logRate_t rates[log_rate_slots];
+static struct timespec clockOffset;	// CLOCK_REALTIME - CLOCK_MONOTONIC
+static FILE *logFile = NULL;
+static pthread_mutex_t fileLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *LogThread(void *arg);
+static void WriteEntry(const logEntry_t *entry);
+static char ConversionType(const char **pfmt, char *spec, int specLen);
+
+int DrvLogInit(void)
+{
+	static int started = 0;
+	struct timespec real, mono;
+	pthread_t tid;
+	unsigned long i;
+
+	if(started)
+		return 0;
+	started = 1;
+	for(i=0; i<log_ring_len; i++)
+		ring[i].seq = i;
+	clock_gettime(CLOCK_REALTIME, &real);
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clockOffset.tv_sec = real.tv_sec - mono.tv_sec;
+	clockOffset.tv_nsec = real.tv_nsec - mono.tv_nsec;
+	if(pthread_create(&tid, NULL, LogThread, NULL) != 0)
+	{
+		printf("Log: create thread error!\n");
+		return -1;
+	}
+	return 0;
+}
+
+void DrvLog(int level, const char *fmt, ...)
+{
+	logEntry_t *entry;
+	unsigned long pos, seq;
+	const char *p;
+	const char *str;
+	char spec[32];
+	char type;
+	int n = 0, textUsed = 0, len;
+	long diff;
+	va_list ap;
+
+	if(level < __atomic_load_n(&logLevel, __ATOMIC_RELAXED))
+		return;
+	pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+	while(1)
+	{
+		entry = &ring[pos & (log_ring_len - 1)];
+		seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+		diff = (long)(seq - pos);
+		if(diff == 0)
+		{
+			if(__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}else if(diff < 0){
+			__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}else{
+			pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &entry->ts);
+	entry->fmt = fmt;
+	entry->level = level;
+	va_start(ap, fmt);
+	for(p=fmt; *p!='\0' && n<log_max_args; )
+	{
+		if(*p++ != '%')
+			continue;
+		type = ConversionType(&p, spec, sizeof(spec));
+		switch(type)
+		{
+			case 'i': case 'c': entry->args[n++].i = va_arg(ap, int); break;
+			case 'l': entry->args[n++].i = va_arg(ap, long); break;
+			case 'L': entry->args[n++].i = va_arg(ap, long long); break;
+			case 'u': entry->args[n++].i = va_arg(ap, unsigned int); break;
+			case 'U': entry->args[n++].i = va_arg(ap, unsigned long); break;
+			case 'Q': entry->args[n++].i = va_arg(ap, unsigned long long); break;
+			case 'z': entry->args[n++].i = va_arg(ap, size_t); break;
+			case 'p': entry->args[n++].i = (long long)(size_t)va_arg(ap, void *); break;
+			case 'd': entry->args[n++].d = va_arg(ap, double); break;
+			case 's':
+				str = va_arg(ap, const char *);
+				if(str == NULL)
+					str = "(null)";
+				len = strlen(str);
+				if(len > log_text_len - textUsed - 1)
+					len = log_text_len - textUsed - 1;
+				if(len < 0)
+					len = 0;
+				memcpy(&entry->text[textUsed], str, len);
+				entry->text[textUsed + len] = '\0';
+				entry->args[n++].s = textUsed;
+				textUsed += len + 1;
+				if(textUsed > log_text_len - 1)
+					textUsed = log_text_len - 1;
+				break;
+			default:
+				break;
+		}
+	}
+	va_end(ap);
+	entry->nargs = n;
+	__atomic_store_n(&entry->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+int DrvLogEnabled(int level)
+{
+	return level >= __atomic_load_n(&logLevel, __ATOMIC_RELAXED);
+}
+
+void DrvLogSetLevel(int level)
+{
+	if(level < DRVLOG_DEBUG)
+		level = DRVLOG_DEBUG;
+	if(level > DRVLOG_ERROR)
+		level = DRVLOG_ERROR;
+	__atomic_store_n(&logLevel, level, __ATOMIC_RELAXED);
+}
+
+int DrvLogGetLevel(void)
+{
+	return __atomic_load_n(&logLevel, __ATOMIC_RELAXED);
+}
+
+void DrvLogSetRateLimit(int perSecond)
+{
+	__atomic_store_n(&rateLimit, perSecond, __ATOMIC_RELAXED);
+}
+
+/* NULL or "" writes to the console. */
+int DrvLogSetFile(const char *path)
+{
+	FILE *fp = NULL;
+	if(path != NULL && path[0] != '\0')
+	{
+		fp = fopen(path, "a");
+		if(fp == NULL)
+		{
+			printf("Log: cannot open %s, keep the current output.\n", path);
+			return -1;
+		}
+	}
+	pthread_mutex_lock(&fileLock);
+	if(logFile != NULL)
+		fclose(logFile);
+	logFile = fp;
+	pthread_mutex_unlock(&fileLock);
+	return 0;
+}
+
+unsigned int DrvLogDropped(void)
+{
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+unsigned int DrvLogSuppressed(void)
+{
+	return suppressedTotal;
+}
+
+static void *LogThread(void *arg)
+{
+	logEntry_t entry;
+	logEntry_t *cell;
+	unsigned long seq;
+
+	while(1)
+	{
+		cell = &ring[dequeuePos & (log_ring_len - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		if(seq != dequeuePos + 1)
+		{
+			usleep(10000);
+			continue;
+		}
+		entry = *cell;
+		__atomic_store_n(&cell->seq, dequeuePos + log_ring_len, __ATOMIC_RELEASE);
+		dequeuePos++;
+		WriteEntry(&entry);
+	}
+	return NULL;
+}
+
+/* Rate limit per format string, in one second windows. */
+static int RateCheck(const logEntry_t *entry, int *suppressed)
+{
+	logRate_t *rate;
+	int limit = __atomic_load_n(&rateLimit, __ATOMIC_RELAXED);
+	size_t slot = ((size_t)entry->fmt >> 3) % log_rate_slots;
+
+	*suppressed = 0;
+	if(limit <= 0)
+		return 1;
+	rate = &rates[slot];
+	if(rate->fmt != entry->fmt || rate->window != entry->ts.tv_sec)
+	{
+		if(rate->fmt == entry->fmt)
+			*suppressed = rate->suppressed;
+		rate->fmt = entry->fmt;
+		rate->window = entry->ts.tv_sec;
+		rate->count = 0;
+		rate->suppressed = 0;
+	}
+	if(rate->count >= limit)
+	{
+		rate->suppressed++;
+		suppressedTotal++;
+		return 0;
+	}
+	rate->count++;
+	return 1;
+}
+
+static void WriteEntry(const logEntry_t *entry)
+{
+	char line[512];
+	char spec[32];
+	const char *p, *start;
+	struct timespec real;
+	struct tm cur_tm;
+	time_t sec;
+	int len, n = 0, suppressed;
+	char type;
+	FILE *out;
+
+	if(!RateCheck(entry, &suppressed))
+		return;
+
+	real.tv_sec = entry->ts.tv_sec + clockOffset.tv_sec;
+	real.tv_nsec = entry->ts.tv_nsec + clockOffset.tv_nsec;
+	if(real.tv_nsec < 0)
+	{
+		real.tv_nsec += 1000000000;
+		real.tv_sec--;
+	}else if(real.tv_nsec >= 1000000000){
+		real.tv_nsec -= 1000000000;
+		real.tv_sec++;
+	}
+	sec = real.tv_sec;
+	localtime_r(&sec, &cur_tm);
+	len = snprintf(line, sizeof(line), "%d-%02d-%02d %02d:%02d:%02d.%03d %s",
+		cur_tm.tm_year+1900, cur_tm.tm_mon+1, cur_tm.tm_mday, cur_tm.tm_hour, cur_tm.tm_min, cur_tm.tm_sec,
+		(int)(real.tv_nsec/1000000),
+		entry->level >= DRVLOG_ERROR ? "Error: " : (entry->level == DRVLOG_WARN ? "Warning: " : ""));
+
+	/* Print the literal text, and each conversion with its own snprintf. */
+	for(p=entry->fmt; *p!='\0' && len<(int)sizeof(line)-1; )
+	{
+		start = p;
+		while(*p != '\0' && *p != '%')
+			p++;
+		len += snprintf(&line[len], sizeof(line)-len, "%.*s", (int)(p-start), start);
+		if(*p == '\0' || len >= (int)sizeof(line)-1)
+			break;
+		p++;
+		type = ConversionType(&p, spec, sizeof(spec));
+		if(type == '%')
+			len += snprintf(&line[len], sizeof(line)-len, "%%");
+		else if(n >= entry->nargs || type == 0)
+			len += snprintf(&line[len], sizeof(line)-len, "?");
+		else if(type == 'd')
+			len += snprintf(&line[len], sizeof(line)-len, spec, entry->args[n++].d);
+		else if(type == 's')
+			len += snprintf(&line[len], sizeof(line)-len, spec, &entry->text[entry->args[n++].s]);
+		else if(type == 'c')
+			len += snprintf(&line[len], sizeof(line)-len, spec, (int)entry->args[n++].i);
+		else
+			len += snprintf(&line[len], sizeof(line)-len, spec, entry->args[n++].i);
+	}
+	if(len >= (int)sizeof(line))
+		len = sizeof(line) - 1;
+	if(suppressed > 0)
+	{
+		len = strcspn(line, "\n");
+		snprintf(&line[len], sizeof(line)-len, " (%d similar messages suppressed)\n", suppressed);
+	}
+
+	pthread_mutex_lock(&fileLock);
+	out = (logFile != NULL) ? logFile : stdout;
+	fputs(line, out);
+	fflush(out);
+	pthread_mutex_unlock(&fileLock);
+}
+
+/* Parse one conversion after the '%'. Returns the argument class: 'i' int,
+   'l' long, 'L' long long, 'u' 'U' 'Q' their unsigned types, 'z' size_t,
+   'c' char, 'p' pointer, 'd' double, 's' string, '%' for "%%" and 0 for an
+   unknown one. spec gets a printf format for the
+   stored value (integers are stored as long long). */
+static char ConversionType(const char **pfmt, char *spec, int specLen)
+{
+	const char *p = *pfmt;
+	char length = 'i';
+	int n = 0;
+
+	spec[n++] = '%';
+	while(*p != '\0' && strchr("-+ #0123456789.", *p) != NULL)
+	{
+		if(n < specLen - 4)
+			spec[n++] = *p;
+		p++;
+	}
+	while(*p == 'h' || *p == 'l' || *p == 'z' || *p == 'j' || *p == 't')
+	{
+		if(*p == 'l')
+			length = (length == 'l') ? 'L' : 'l';
+		else if(*p == 'z' || *p == 'j' || *p == 't')
+			length = 'z';
+		p++;
+	}
+	*pfmt = (*p != '\0') ? p + 1 : p;
+	switch(*p)
+	{
+		case '%':
+			return '%';
+		case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+			spec[n++] = 'l';
+			spec[n++] = 'l';
+			spec[n++] = *p;
+			spec[n] = '\0';
+			if(*p == 'd' || *p == 'i' || length == 'z')
+				return length;
+			return (length == 'i') ? 'u' : ((length == 'l') ? 'U' : 'Q');
+		case 'c':
+			spec[n++] = 'c';
+			spec[n] = '\0';
+			return 'c';
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+			spec[n++] = *p;
+			spec[n] = '\0';
+			return 'd';
+		case 's':
+			spec[n++] = 's';
+			spec[n] = '\0';
+			return 's';
+		case 'p':
+			snprintf(spec, specLen, "0x%%llx");
+			return 'p';
+		default:
+			spec[n] = '\0';
+			return 0;
+	}
+}
@@ -0,0 +1,34 @@
+/* driverLog.h */
+/* Author:  Gao    Create Date:  19Oct2026 */
+/* The last modified date:  19Oct2026 */
+
+#ifndef _driverLog_H
+#define _driverLog_H
+
+#define DRVLOG_DEBUG 0
+#define DRVLOG_INFO 1
+#define DRVLOG_WARN 2
+#define DRVLOG_ERROR 3
+
+/* The following functions will be called from driver layer.**************/
+int DrvLogInit(void);
+
+/* fmt must be a string literal, it is formatted later on the log thread.
+   At most 6 arguments; %s arguments are copied into the entry. */
+void DrvLog(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+int DrvLogEnabled(int level);
+
+void DrvLogSetLevel(int level);
+
+int DrvLogGetLevel(void);
+
+void DrvLogSetRateLimit(int perSecond);
+
+int DrvLogSetFile(const char *path);
+
+unsigned int DrvLogDropped(void);
+
+unsigned int DrvLogSuppressed(void);
+
+#endif
@@ -1,8 +1,34 @@
 /* driverWrapper.c */
 /* Author:  Gao    Create Date:  02Nov2021 */
-/* The last modified date:  04Apr2025 */
+/* The last modified date:  19Oct2026 */
 // 2025.04.04
 // Revise waveform channel order;
+// 2026.10.19
+// Latch pulse mode and average/background windows once per trigger frame;
+// Shadow register cache for SetReg() and staged calibration transactions;
+// Save applied setpoints to a binary snapshot and restore them in InitDevice;
+// Calibration parameters come from the hot-reloadable calibration store;
+// Log through the asynchronous driver log instead of GetSysTime()+printf;
+// Latch the device timestamp with each frame, converted once to epicsTimeStamp;
+// Software interlock preview of the X/Y and sum waveforms against the limits;
+// Packed trigger frame waveform with all processed channels of one pulse;
+// Per-pulse scalars on their own I/O Intr list, waveforms at a divisor/max rate;
+// Gate duplicate and beam-absent frames, publish them only at a keep-alive rate;
+// Opt-in real-time acquisition thread (policy, priority, affinity, mlockall) and jitter histogram;
+// Process the channels of a frame on a worker pool, scan each channel's records when it is ready;
+// Software X/Y waveforms from the pickup amplitudes with residual RMS against the FPGA X/Y;
+// Nonlinear position maps (polynomial or bilinear grid) applied to X/Y waveforms and averages;
+// Baseline-corrected amplitude waveforms, running baseline and per-pulse charge over gates;
+// Boxcar and exponential N-pulse averages of the trigger waveforms;
+// Two-BPM phase difference, time of flight and energy deviation per pulse;
+// Capture the history buffer automatically on an interlock or clock trip, tagged with time and cause;
+// Poll all status bits in one thread, WR-timestamped edges to I/O Intr bi records and an event ring;
+// Zero-copy waveform delivery from reference counted frame buffers, converted in place;
+// Integer count waveforms (FTVL SHORT/LONG) with the count scale as slope/offset;
+// Demand-driven waveform scans, trigger waveforms nobody monitors are not scanned or read;
+// Raw ADC capture, continuous at a reduced rate or armed bursts of consecutive pulses into a ring;
+// ADC spectral diagnostics (SNR, SINAD, SFDR, ENOB, noise floor, spur) on a CPU budget;
+// Record the lowlevel data and status to a file, or replay a recording in place of the hardware;
 
 #include <stddef.h>
 #include <stdlib.h>
@@ -13,13 +39,25 @@
 #include <time.h>
 #include <stdint.h>
 #include <unistd.h>  //The standard unix I/O, include sleep function.
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <dlfcn.h>
 
 #include <drvSup.h>
+#include <epicsTime.h>
+#include <iocsh.h>
+#include <initHooks.h>
 #include <epicsExport.h>
 
 #include "driverWrapper.h"
+#include "calibrationStore.h"
+#include "positionMap.h"
+#include "frameBuffer.h"
+#include "adcSpectrum.h"
+#include "lowLevelReplay.h"
+#include "driverLog.h"
 
 typedef uint64_t U64;
 typedef uint32_t U32;
@@ -32,37 +70,21 @@ typedef uint32_t U32;
 
 #define CSVfile_Path "/mnt/BPM_2bpmIn1Chassis_ioc/parameter/llrfparameters.csv"
 
+#define snapshot_magic 0x534d5042	// "BPMS"
+#define snapshot_version 1
+
+#define frame_magic 0x464d5042	// "BPMF"
+#define frame_version 1
+
+#define wr_local_offset (8*60*60)	// WR seconds are kept in local time (UTC+8)
+#define wr_ns_per_tick 16	// WR sub-second counter runs at 62.5 MHz
+
 static IOSCANPVT TriginScanPvt;
+static IOSCANPVT ScalarinScanPvt;
 static IOSCANPVT TripBufferinScanPvt;
 static IOSCANPVT ADCrawBufferinScanPvt;
-
-static double parameters[9][7]={0};
-
-// static float rf1amp[buf_len];
-// static float rf2amp[buf_len];
-static float rf3amp[buf_len];
-static float rf4amp[buf_len];
-static float rf5amp[buf_len];
-static float rf6amp[buf_len];
-static float rf7amp[buf_len];
-static float rf8amp[buf_len];
-static float rf9amp[buf_len];
-static float rf10amp[buf_len];
-// static float rf1phase[buf_len];
-// static float rf2phase[buf_len];
-static float rf3phase[buf_len];
-static float rf4phase[buf_len];
-static float rf5phase[buf_len];
-static float rf6phase[buf_len];
-static float rf7phase[buf_len];
-static float rf8phase[buf_len];
-static float rf9phase[buf_len];
-static float rf10phase[buf_len];
-
-static float X1[buf_len];
-static float Y1[buf_len];
-static float X2[buf_len];
-static float Y2[buf_len];
+static IOSCANPVT StatusinScanPvt;
+static IOSCANPVT SpecinScanPvt;
 
 // static float rf1amp_trip[trip_buf_len];
 // static float rf2amp_trip[trip_buf_len];
@@ -75,6 +97,8 @@ static float Y2[buf_len];
 // static float rf9amp_trip[trip_buf_len];
 // static float rf10amp_trip[trip_buf_len];
 
+static float frameDmaBuf[buf_len];	// pthread() only
+
 static float HistoryX1[trip_buf_len];
 static float HistoryY1[trip_buf_len];
 static float HistoryX2[trip_buf_len];
@@ -103,12 +127,390 @@ static float HistoryY2[trip_buf_len];
 static int ReadWfActionCounter=0;
 // static int historyDataFlag=0;
 
-static int pulseMode=0;
-static int AVGStart=0;
-static int AVGStop=0;
+/* Processing configuration. SetReg() only edits pendingCfg, pthread() copies it
+   to frameCfg once per trigger frame, so all records of a frame use the same
+   windows and mode. A pending set that fails validation is not applied. */
+typedef struct {
+	int pulseMode;
+	int AVGStart;
+	int AVGStop;
+	int BackGroundStart;
+	int BackGroundStop;
+	unsigned int epoch;
+}procConfig_t;
+
+static pthread_mutex_t cfgLock = PTHREAD_MUTEX_INITIALIZER;
+static procConfig_t pendingCfg = {0, 0, 0, 0, 0, 0};
+static procConfig_t frameCfg = {0, 0, 0, 0, 0, 0};
+static int pendingCfgValid = 1;
+
+/* Shadow copy of the values SetReg() has written to liblowlevel.so. A write of
+   the value already in hardware is skipped. While a calibration transaction is
+   open, calibration writes are only staged and go to hardware on commit.
+   A register with a read-back getter is checked after each write. */
+#define shadow_reg_num 29
+#define shadow_ch_num 16
+
+typedef struct {
+	float value;	// last value written to hardware
+	float staged;	// value waiting for the commit
+	unsigned char valid;
+	unsigned char dirty;
+}shadowReg_t;
+
+static pthread_mutex_t hwLock = PTHREAD_MUTEX_INITIALIZER;
+static shadowReg_t shadowRegs[shadow_reg_num][shadow_ch_num];
+static int calTransaction=0;
+static int calStagedWrites=0;
+static unsigned int regWritesSkipped=0;
+static unsigned int regWritesApplied=0;
+static unsigned int regReadbackErrors=0;
+
+/* Setpoint snapshot. Every change of a shadow register marks it dirty, and so
+   does a new calibration table version; SnapshotThread() writes it at most
+   once per second. */
+typedef struct {
+	U32 magic;
+	U32 version;
+	U32 count;	// number of snapshotEntry_t
+	U32 rows;	// parameters table size
+	U32 columns;
+	U32 checksum;	// FNV-1a of everything after the header
+}snapshotHeader_t;
+
+typedef struct {
+	unsigned short offset;
+	unsigned short channel;
+	float value;
+}snapshotEntry_t;
+
+static char calFilePath[256] = CSVfile_Path;
+static char snapshotPath[256] = "/mnt/BPM_2bpmIn1Chassis_ioc/parameter/BPMsetpoints.snap";
+static int snapshotDirty=0;
+static unsigned int snapshotCalVersion=0;	// calibration table version in the snapshot
+static int snapshotRestored=0;	// setpoints restored at InitDevice
+static float snapshotRestoreTime=0;	// ms
+static float iocStartupTime=0;	// s, process start to iocInit finished
+static struct timespec initDeviceTime;
+
+/* Software interlock preview. Every trigger frame, X1 Y1 X2 Y2 (ch 16-19) and
+   Vsum1 Vsum2 (ch 20-21) are compared sample by sample with the limits last
+   written by SetBPMxyLimits()/SetBPMSumLimits(). The excursion is how far a
+   sample is beyond its limit; the peak is negative while there is margin. */
+#define preview_num 6
+
+typedef struct {
+	int firstIndex;	// -1 if no sample is beyond the limit
+	int count;
+	float peak;
+}preview_t;
+
+static pthread_mutex_t previewLock = PTHREAD_MUTEX_INITIALIZER;
+static preview_t previewResult[preview_num];
+
+/* Packed trigger frame, published by one waveform record with FTVL UCHAR:
+   frameHeader_t, U32 lengths[nChannels], then every channel as float32 in
+   frameChannels[] order, each exactly as its own ARRAY record publishes it. */
+typedef struct {
+	U32 magic;
+	unsigned short version;
+	unsigned short headerBytes;	// frameHeader_t + lengths
+	U32 secPastEpoch;	// EPICS epoch, same stamp as TSE=-2 records
+	U32 nsec;
+	U32 seq;	// frame sequence number
+	U32 nChannels;
+}frameHeader_t;
+
+/* Waveform publication rate. Per-pulse scalars are computed and posted on
+   every frame; the waveform list is posted on every wfDivisor-th frame and
+   not faster than wfMaxRate. */
+static int wfDivisor=1;
+static float wfMaxRate=0;	// Hz, 0 = no limit
+static unsigned int wfPosted=0;
+static struct timespec wfLastPost;
+
+/* Frame gating. A frame with the timestamp of the previous one is a
+   duplicate; a frame whose Vsum1 and Vsum2 averages over the average window
+   are both below beamThreshold has no beam. Gated frames are neither
+   converted nor posted, except one every keepAlive seconds. */
+static float beamThreshold=0;	// raw sum, 0 = no beam detection
+static float keepAlive=0;	// s, 0 = never publish gated frames
+static unsigned int framesDuplicate=0;
+static unsigned int framesNoBeam=0;
+static unsigned int framesPublished=0;
+static int beamPresent=0;
+static epicsTimeStamp lastFrameTime;
+static struct timespec lastPublish;
+
+/* Real-time mode of the acquisition thread, set by BPMRealTime() in st.cmd
+   before iocInit. Without it pthread() runs with the default scheduling. */
+static int rtPolicy=SCHED_OTHER;
+static int rtPriority=0;
+static cpu_set_t rtCpus;
+static int rtCpusSet=0;
+static int rtLockMemory=0;
+static int rtActive=0;	// acquisition thread runs with the requested attributes
+
+/* Wakeup latency of the acquisition thread, how far past the deadline of its
+   sleep it runs again; bucket upper bounds in us. The frame processing time
+   is kept apart in procTimeLast/procTimeMax. */
+static const int jitterBounds[] = {10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000};
+#define jitter_bucket_num (sizeof(jitterBounds)/sizeof(jitterBounds[0]) + 1)
+static unsigned int jitterHist[jitter_bucket_num];
+static float jitterLast=0;	// us
+static float jitterMax=0;	// us
+
+static const int frameChannels[] = {
+	11, 12, 13, 14, 15, 16, 17, 18,	// amplitude
+	21, 22, 23, 24, 25, 26, 27, 28,	// phase
+	61, 62, 63, 64,	// X1 Y1 X2 Y2
+	65, 66	// Vsum1 Vsum2
+};
+#define frame_channel_num (sizeof(frameChannels)/sizeof(frameChannels[0]))
+
+/* Per-channel frame processing. Each channel of frameChannels[] is fetched
+   and converted in place once per published frame into a new frame buffer,
+   by the worker pool and pthread() together, which then replaces chanWf[k]
+   (X/Y only once CorrectPositions() has corrected them); the records of a
+   channel are scanned as soon as that channel is ready.
+   readWaveform() copies from chanWf[], AcquireWaveform() hands out a
+   reference to it. */
+#define max_workers 8
+
+static float *chanWf[frame_channel_num];
+static pthread_mutex_t chanLock[frame_channel_num];
+/* New X/Y buffers of the frame for chanWf[16..19], NULL if none was free. */
+static float *xyNext[4];
+static IOSCANPVT chanScanPvt[frame_channel_num];
+
+static int poolSize=0;	// worker threads besides pthread()
+static int poolPriority=0;
+static cpu_set_t poolCpus;
+static int poolCpusSet=0;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+static unsigned int poolGeneration=0;
+static unsigned int poolNext=0;	// next channel to take
+static unsigned int poolPending=0;	// channels not finished
+static int poolPost=0;	// scan the channel lists of this frame
+static float procTimeLast=0;	// us, frame arrival to all channels ready
+static float procTimeMax=0;
+
+/* liblowlevel is not known to be reentrant: every GetTriggerAllData() goes
+   through ReadTriggerData() under dmaLock, the workers overlap only the
+   conversion of the channels. */
+static pthread_mutex_t dmaLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Zero-copy waveform delivery. With zeroCopy set a waveform record points its
+   BPTR at the frame buffer of its channel and keeps a reference to it until
+   its next read. CaptureHistory() then also reads the history channels into
+   historyWf[] (by lowlevel channel, X/Y converted to um) under tripLock. */
+#define history_channel_num 22
+
+static int trigPool=-1;	// buf_len samples
+static int histPool=-1;	// trip_buf_len samples
+static int zeroCopy=0;
+static unsigned int framesDropped=0;	// channel frames dropped, no frame buffer
+static float *historyWf[history_channel_num];
+
+/* Demand-driven scans. Every trigger waveform offset outside frameChannels[]
+   has its own scan list in wfScanPvt[]. Device support counts the monitors on
+   the I/O Intr records of each offset about once a second through demandHook.
+   With demandDriven set, an offset whose records nobody monitors is not
+   scanned, so the raw ADC channels (1-8) are not read from lowlevel at all.
+   The processed channels are still fetched and converted every frame, each
+   of them feeds a per-pulse scalar (baseline, charge, flattop phase, X/Y
+   average, interlock preview); only the scan of their records is skipped.
+   The packed frame (offset 0) wants every channel. */
+#define demand_offset_num 128
+
+static int demandDriven=0;
+static IOSCANPVT wfScanPvt[demand_offset_num];
+static unsigned short wfDemand[demand_offset_num];	// monitors on the records of the offset
+static unsigned char wfHasRecords[demand_offset_num];
+static void (*demandHook)(void)=NULL;
+static unsigned int scansPosted=0;	// waveform scan lists posted
+static unsigned int scansSkipped=0;	// not posted, nobody monitors them
+
+/* Raw ADC capture. pthread() reads the 8 raw ADC channels of a frame into a
+   slot of adcRing[], preallocated for adcRingPulses pulses (BPMADCCapture).
+   In continuous mode one gated pulse is taken at most adcRate times a second;
+   in burst mode, once armed, the next gated pulse and the ones after it fill
+   adcBurstPulses slots. A software trigger starts either on the next frame
+   whatever the gate. The ADCrawBuffer records (ARRAY:125-132) are scanned
+   when a capture is done and show slot adcSelect. All under adcLock. */
+#define adc_channel_num 8
+#define adc_buf_len 40000
+#define adc_ring_max 64
+#define ADC_IDLE 0
+#define ADC_ARMED 1
+#define ADC_CAPTURING 2
+#define ADC_DONE 3
+
+static pthread_mutex_t adcLock = PTHREAD_MUTEX_INITIALIZER;
+static int adcRingPulses=4;
+static int adcRingFixed=0;	// InitDevice() has sized the ring
+static float *adcRing=NULL;	// adcRingPulses * adc_channel_num * adc_buf_len
+static epicsTimeStamp *adcStamp=NULL;	// frame time of each slot
+static int adcMode=0;	// 0 off, 1 continuous, 2 burst
+static int adcState=ADC_IDLE;
+static int adcForce=0;	// software trigger pending
+static int adcBurstPulses=1;
+static int adcCaptured=0;	// slots filled by the last capture
+static int adcSelect=0;
+static float adcRate=1;	// Hz, continuous mode, <= 0 on trigger only
+static struct timespec adcLast;
+static float adcTimeLast=0;	// ms, reading the 8 channels of one pulse
+static unsigned int adcCaptures=0;
+
+/* ADC spectral diagnostics. SpectrumThread() takes the raw ADC channels one at
+   a time, round robin, and analyses them with adcSpectrum.c: at most specRate
+   channels a second, and never more than specMaxDuty percent of one CPU as
+   measured on the analyses and the raw reads they take on pthread() (0 no
+   limit). It runs without real-time priority. It asks for a channel in
+   specWant and pthread() reads that channel of the next gated frame into
+   specRaw (FeedSpectrum()), or copies it if CaptureADC() has just read the
+   frame, so the data and the stamp come from one frame. The results and a peak-held spectrum of
+   spec_points bins per channel go with specLock. */
+#define spec_points 1024
+#define spec_frame_timeout 1	// s, waiting for a gated frame
+
+static pthread_mutex_t specLock = PTHREAD_MUTEX_INITIALIZER;
+static int specEnable=0;
+static float specRate=1;	// channels per second
+static float specMaxDuty=2;	// percent of one CPU
+static float specSampleRate=100;	// MHz
+static float specFullScale=32768;	// counts, amplitude of a full-scale sine
+static specResult_t specResult[adc_channel_num];
+static float specWf[adc_channel_num][spec_points];	// dBFS
+static epicsTimeStamp specStamp[adc_channel_num];
+static float specTimeLast=0;	// ms, reading and analysing one channel
+static float specDuty=0;	// percent, of the last period
+static pthread_cond_t specCond = PTHREAD_COND_INITIALIZER;
+static int specWant=-1;	// channel SpectrumThread() waits for, -1 none
+static int specGot=0;
+static float specRaw[adc_buf_len];
+static epicsTimeStamp specRawStamp;
+static double specRawTime;	// s, filling specRaw on pthread()
+
+/* Integer waveforms. A record with FTVL SHORT or LONG gets the counts of the
+   channel, value = slope*count + offset (WaveformScale()). Waveforms without
+   a frame buffer are read into countsBuf first. */
+static pthread_mutex_t countsLock = PTHREAD_MUTEX_INITIALIZER;
+static float *countsBuf=NULL;
+static unsigned int countsLen=0;
+
+/* Software X/Y, k*(A-C)/(A+C)+offset per sample from the amplitude channels
+   of the frame, beside the FPGA X/Y. softPickups[] are the A/C (B/D) channels
+   of X1 Y1 X2 Y2 in chanWf[]. */
+static const int softPickups[4][2] = {{0, 2}, {1, 3}, {4, 6}, {5, 7}};
+static float softXY[4][buf_len];
+static float softRms[4];	// um, software minus FPGA over the average window
+static pthread_mutex_t softLock = PTHREAD_MUTEX_INITIALIZER;
+static float mapTimeLast=0;	// us, position map correction of the last frame
+
+/* Integration stage of the amplitude channels (chanWf[0..7]). The baseline is
+   the background window mean of the pulse, or with baselineFrames > 0 a
+   running mean of it over about that many pulses. chanBase[] is the waveform
+   minus the baseline, the charge of a BPM is its four corrected pickups summed
+   over each gate, times chargeScale. chanBase[k] and baseRun[k] go with
+   chanLock[k], the rest with chargeLock. */
+#define charge_gate_num 4
+
+static float chanBase[8][buf_len];
+static float baseline[8];	// V, baseline used for the last frame
+static float baseRun[8];
+static unsigned int baseRunEpoch[8];
+static int baselineFrames=0;
+static unsigned int baselineEpoch=0;	// changed whenever baselineFrames is set
+static pthread_mutex_t chargeLock = PTHREAD_MUTEX_INITIALIZER;
+static int gateStart[charge_gate_num] = {-1, -1, -1, -1};
+static int gateStop[charge_gate_num] = {-1, -1, -1, -1};
+static float chargeScale[2] = {1, 1};	// per V*sample
+static float charge[2][charge_gate_num];
+
+/* N-pulse average of every channel of frameChannels[], updated once per
+   published frame after the X/Y correction. The boxcar keeps the last
+   avgPulses frames in avgRing[] to take the oldest one out of the sum, the
+   exponential average needs only avgAcc[]. */
+#define avg_max_boxcar 32
+
+static pthread_mutex_t avgLock = PTHREAD_MUTEX_INITIALIZER;
+static int avgMode=0;	// 0 off, 1 boxcar, 2 exponential
+static int avgPulses=1;
+static int avgCount=0;	// pulses in the average, up to avgPulses
+static int avgHead=0;	// ring slot of the oldest pulse
+static float *avgRing=NULL;	// avgPulses slots of frame_channel_num*buf_len
+static double avgAcc[frame_channel_num][buf_len];
+static float avgTimeLast=0;	// us
+
+/* Phase difference BPM2 - BPM1 along the pulse, from the pickups used for
+   the BPM phases of ReadData(32/33), pairwise (ph4/ph8, ph5/ph9, ph6/ph10)
+   and wrapped to +-180 deg. A later arrival at BPM2 reads as a larger
+   difference. The time of flight is L/(beta*c) at the nominal energy plus
+   (dphi - dphi0)/(360*f), and dW/W = -gamma*(gamma+1)*dt/t. */
+static float phaseDiffWf[buf_len];
+static float phaseDiff=0;	// deg, over the average window
+static float tofDelta=0;	// ps
+static float tofTotal=0;	// ns
+static float energyDev=0;	// dW/W
+static double flightDistance=0;	// m
+static double rfFrequency=0;	// MHz
+static double phaseDiffRef=0;	// deg
+static double beamEnergy=0;	// MeV, kinetic
+static double restMass=938.272;	// MeV, proton
+static pthread_mutex_t corrLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Status poller. StatusPollThread() reads the trip bits once per
+   watchPeriod us (10 ms by default, 1 ms at most), the WR status bits once
+   per status_slow_period us, stamps each edge with the WR time, keeps the
+   last status_ring_len edges in statusRing[] and scans the status records
+   (ReadData 82). Status bits: 0-3 xyProtect ch0-3, 4-6 SumProtect ch0-2,
+   7 ADC clock, 8-9 WR status ch0-1; bits 0-7 are trips. */
+#define status_bit_num 10
+#define status_slow_period 500000	// us, the old scan period of the WR status
+#define status_min_period 1000	// us
+#define status_ring_len 64
+#define trip_cause_clock 0x80
+#define trip_mask 0xff
+
+typedef struct {
+	epicsTimeStamp stamp;
+	int bit;
+	int value;
+}statusEvent_t;
+
+static pthread_mutex_t statusLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int statusWord=0;
+static epicsTimeStamp statusTime[status_bit_num];	// last edge of each bit
+static statusEvent_t statusRing[status_ring_len];
+static unsigned int statusEvents=0;	// edges seen, statusRing[(statusEvents-1)%len] is the newest
+static float pollTimeLast=0;	// us, reading all status bits once
+
+/* History capture. On a new trip the poller hands the time and cause to
+   HistoryCaptureThread(), which freezes and reads the history storage like
+   the @REG:3 bo does. historyLock serializes the two ways in. The history
+   waveforms carry historyStamp, the trip time or the time of a manual read.
+   The cause is the trip bits of the status word. */
+
+static pthread_mutex_t historyLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t tripLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tripCond = PTHREAD_COND_INITIALIZER;
+static int autoCapture=0;
+static int watchPeriod=10000;	// us
+static int tripPending=0;
+static unsigned int tripPendingCause=0;
+static epicsTimeStamp tripPendingStamp;
+static struct timespec tripPendingMono;
+static epicsTimeStamp historyStamp;
+static unsigned int historyCause=0;	// 0 for a manual read
+static unsigned int tripCount=0;
+static unsigned int tripsMissed=0;	// trips while a capture was running
+static float captureLatency=0;	// ms, trip to history posted
+static float publishLatency=0;	// ms, trip to the last history waveform read
+static struct timespec historyMono;	// trip (or manual read) time, monotonic
 
-static int BackGroundStart=0;
-static int BackGroundStop=0;
 static int rf3_avg_volt=0;
 static int rf4_avg_volt=0;
 static int rf5_avg_volt=0;
@@ -142,10 +544,19 @@ static float ph_offset9=0;
 static float ph_ch10=0;
 static float ph_offset10=0;
 
-static long long TAISecond=0;
-static int TAINanoSecond=0;
+/* Device time of the latest trigger frame. pthread() reads it as soon as the
+   frame has arrived, before any record of the frame is scanned. */
+static epicsTimeStamp frameTime = {0, 0};
+static unsigned int frameSeq=0;
+
+/* Seqlock of the published frame: odd from LatchFrameTime() until ProcessFrame()
+   has replaced every chanWf[] buffer, even in between. A reader that sees the
+   same even value before and after its copy has one whole frame. */
+#define frame_read_tries 20
+static unsigned int frameUpdateSeq=0;
 
 static long InitDevice(); 
+static long ReportDevice(int level);
 
 struct {
     long number;
@@ -153,7 +564,7 @@ struct {
     DRVSUPFUN init;
 } drWrapper = {
     2,
-    NULL,
+    ReportDevice,
     InitDevice
 };
 epicsExportAddress(drvet, drWrapper);
@@ -212,7 +623,37 @@ static void (*funcSetSelectExternelTrigger)(int value);
 static void SetSysTime(void);
 
 // calculate average voltage of each channel
-static void calculateAvgVoltage(float *wfBuf, int ch_N, int length);
+static void calculateAvgVoltage(const float *baseBuf, int ch_N, int length);
+
+static void  ReadCSVparametersfile(int value);
+
+// setpoint snapshot for warm start
+static void MarkSnapshotDirty(void);
+static int SaveSnapshot(void);
+static int RestoreSnapshot(void);
+static void *SnapshotThread(void *arg);
+static void StartupTimeHook(initHookState state);
+
+// interlock-triggered history capture
+static void *StatusPollThread(void *arg);
+static void *HistoryCaptureThread(void *arg);
+
+static void *SpectrumThread(void *arg);
+
+// real-time acquisition thread
+static int CreateAcqThread(void);
+static int CreateRtThread(void *(*func)(void *), int priority, int cpusSet, cpu_set_t *cpus);
+static void *PoolWorker(void *arg);
+static void PrefaultStack(void);
+static void AcqSleep(int us);
+static void ResetJitter(void);
+static void ReportJitter(void);
+
+/* An entry point of liblowlevel, or its stand-in when replaying or recording. */
+static void *LowLevelSym(void *handle, const char *name)
+{
+	return ReplaySymbol(name, (handle != NULL) ? dlsym(handle, name) : NULL);
+}
 
 static long InitDevice()
 {
@@ -220,80 +661,152 @@ static long InitDevice()
 	printf("############################################################################\n");
 	void *handle;
 	int (*funcOpen)();
+	int i;
 
-	handle = dlopen(DLL_FILE_NAME, RTLD_NOW);
-	if (handle == NULL)
+	DrvLogInit();
+	clock_gettime(CLOCK_MONOTONIC, &initDeviceTime);
+	initHookRegister(StartupTimeHook);
+
+	handle = NULL;	// replaying, the recording stands in for the hardware
+	if(ReplayMode() != replay_mode_replay)
 	{
-		fprintf(stderr, "Failed to open libaray %s error:%s\n", DLL_FILE_NAME, dlerror());
-		return -1;
+		handle = dlopen(DLL_FILE_NAME, RTLD_NOW);
+		if (handle == NULL)
+		{
+			fprintf(stderr, "Failed to open libaray %s error:%s\n", DLL_FILE_NAME, dlerror());
+			return -1;
+		}
 	}
+	if(ReplayOpen(buf_len, adc_buf_len, trip_buf_len) != 0)
+		return -1;
 
-	funcOpen = dlsym(handle, "SystemInit");
+	funcOpen = LowLevelSym(handle, "SystemInit");
 	int result = funcOpen();
 	if(result == 0)
 	{
 		printf("Open System success!\n");
 	}
 
-	funcGetRfInfo = dlsym(handle, "GetRfInfo");
-	funcGetDI = dlsym(handle, "GetDI");
-	funcSetDO = dlsym(handle, "SetDO");
-	funcGetFPGA_LED0_RBK = dlsym(handle, "GetFPGA_LED0");
-	funcGetFPGA_LED1_RBK = dlsym(handle, "GetFPGA_LED1");
-	funcSetArmLedEnable = dlsym(handle, "SetArmLedEnable");
-	funcSetFanLedStatus = dlsym(handle, "SetFanLedStatus");
-	funcSetOutputPulseEnable = dlsym(handle, "SetOutputPulseEnable");  //RF pulse switch.
-	funcSetInnerTrigEn = dlsym(handle, "SetInnerTrigEn");  //Select Inner or external Trig Enable to collect data.
-	funcGetHistoryDataReady = dlsym(handle, "GetStorageDataReady");
-	funcSetHistoryTrigger = dlsym(handle, "SetHistoryTrigger");
-	funcSetResetHistoryStorage = dlsym(handle, "SetRsetDataStorage");
-	funcSetTriggerExtractDataRatio = dlsym(handle, "SetTriggerExtractDataRatio");
-	funcSetHistoryExtractDataRatio = dlsym(handle, "SetHistoryExtractDataRatio");
+	funcGetRfInfo = LowLevelSym(handle, "GetRfInfo");
+	funcGetDI = LowLevelSym(handle, "GetDI");
+	funcSetDO = LowLevelSym(handle, "SetDO");
+	funcGetFPGA_LED0_RBK = LowLevelSym(handle, "GetFPGA_LED0");
+	funcGetFPGA_LED1_RBK = LowLevelSym(handle, "GetFPGA_LED1");
+	funcSetArmLedEnable = LowLevelSym(handle, "SetArmLedEnable");
+	funcSetFanLedStatus = LowLevelSym(handle, "SetFanLedStatus");
+	funcSetOutputPulseEnable = LowLevelSym(handle, "SetOutputPulseEnable");  //RF pulse switch.
+	funcSetInnerTrigEn = LowLevelSym(handle, "SetInnerTrigEn");  //Select Inner or external Trig Enable to collect data.
+	funcGetHistoryDataReady = LowLevelSym(handle, "GetStorageDataReady");
+	funcSetHistoryTrigger = LowLevelSym(handle, "SetHistoryTrigger");
+	funcSetResetHistoryStorage = LowLevelSym(handle, "SetRsetDataStorage");
+	funcSetTriggerExtractDataRatio = LowLevelSym(handle, "SetTriggerExtractDataRatio");
+	funcSetHistoryExtractDataRatio = LowLevelSym(handle, "SetHistoryExtractDataRatio");
 //	funcGetHistoryData = dlsym(handle, "GetHistoryData");
 //	funcGetTriggerData = dlsym(handle, "GetTriggerData");
-	funcSetSyncIQStartSign = dlsym(handle, "SetChangeStartIQSig");
+	funcSetSyncIQStartSign = LowLevelSym(handle, "SetChangeStartIQSig");
 //	funcGetTriggerAdcData = dlsym(handle, "GetTriggerAdcData");
-	funcHistoryChannelDataReached = dlsym(handle, "HistoryChannelDataReached");
-	funcGetHistoryChannelData = dlsym(handle, "GetHistoryChannelData");
+	funcHistoryChannelDataReached = LowLevelSym(handle, "HistoryChannelDataReached");
+	funcGetHistoryChannelData = LowLevelSym(handle, "GetHistoryChannelData");
 //	funcTriggerChannelDataReached = dlsym(handle, "TriggerChannelDataReached");
 //	funcADCChannelDataReached = dlsym(handle, "ADCChannelDataReached");
 //	funcGetTriggerChannelData = dlsym(handle, "GetTriggerChannelData");
 //	funcGetADCChannelData = dlsym(handle, "GetADCChannelData");
-	funcTriggerAllDataReached = dlsym(handle, "TriggerAllDataReached");
-	funcGetTriggerAllData = dlsym(handle, "GetTriggerAllData");
-	funcGetADclkState = dlsym(handle, "GetPlBrokenState");
-	funcGetVcValue = dlsym(handle, "GetVcValue");
-	funcGetBPMPhaseValue = dlsym(handle, "GetBPMPhaseValue");
-	funcGetxyPosition = dlsym(handle, "GetxyPosition");
-	funcGetVcSumValue = dlsym(handle, "GetVcSumValue");
-	funcGetxyProtect = dlsym(handle, "GetxyProtect");
-	funcSetBPMk1 = dlsym(handle, "SetBPMk1");
-	funcSetBPMk2 = dlsym(handle, "SetBPMk2");
-	funcSetBPMk3 = dlsym(handle, "SetBPMk3");
-	funcSetBPMPhaseOffset = dlsym(handle, "SetBPMPhaseOffset");
-	funcSetBPMkxy = dlsym(handle, "SetBPMkxy");
-	funcSetBPMxyOffset = dlsym(handle, "SetBPMxyOffset");
-	funcSetBPMxyLimits = dlsym(handle, "SetBPMxyLimits");
-	funcSetReset = dlsym(handle, "SetReset");
-	funcSetBPMSumLimits = dlsym(handle, "SetBPMSumLimits");
-	funcGetSumProtect = dlsym(handle, "GetSumProtect");
-	funcSetBPMProtectFilterTime = dlsym(handle, "SetBPMProtectFilterTime");
-	funcGetWRStatus = dlsym(handle, "GetWRStatus");
-	funcSetWRCaputureDataTrigger = dlsym(handle, "SetWRCaputureDataTrigger");
-	funcGetTimestampData = dlsym(handle, "GetTimestampData");
-	funcSetFreqControlWordtoDDS = dlsym(handle, "SetFreqControlWordtoDDS");
-	funcSetSelectExternelTrigger = dlsym(handle, "SetSelectExternelTrigger");
-
-	pthread_t tidp1;
-	if(pthread_create(&tidp1, NULL, pthread, NULL) == -1)
+	funcTriggerAllDataReached = LowLevelSym(handle, "TriggerAllDataReached");
+	funcGetTriggerAllData = LowLevelSym(handle, "GetTriggerAllData");
+	funcGetADclkState = LowLevelSym(handle, "GetPlBrokenState");
+	funcGetVcValue = LowLevelSym(handle, "GetVcValue");
+	funcGetBPMPhaseValue = LowLevelSym(handle, "GetBPMPhaseValue");
+	funcGetxyPosition = LowLevelSym(handle, "GetxyPosition");
+	funcGetVcSumValue = LowLevelSym(handle, "GetVcSumValue");
+	funcGetxyProtect = LowLevelSym(handle, "GetxyProtect");
+	funcSetBPMk1 = LowLevelSym(handle, "SetBPMk1");
+	funcSetBPMk2 = LowLevelSym(handle, "SetBPMk2");
+	funcSetBPMk3 = LowLevelSym(handle, "SetBPMk3");
+	funcSetBPMPhaseOffset = LowLevelSym(handle, "SetBPMPhaseOffset");
+	funcSetBPMkxy = LowLevelSym(handle, "SetBPMkxy");
+	funcSetBPMxyOffset = LowLevelSym(handle, "SetBPMxyOffset");
+	funcSetBPMxyLimits = LowLevelSym(handle, "SetBPMxyLimits");
+	funcSetReset = LowLevelSym(handle, "SetReset");
+	funcSetBPMSumLimits = LowLevelSym(handle, "SetBPMSumLimits");
+	funcGetSumProtect = LowLevelSym(handle, "GetSumProtect");
+	funcSetBPMProtectFilterTime = LowLevelSym(handle, "SetBPMProtectFilterTime");
+	funcGetWRStatus = LowLevelSym(handle, "GetWRStatus");
+	funcSetWRCaputureDataTrigger = LowLevelSym(handle, "SetWRCaputureDataTrigger");
+	funcGetTimestampData = LowLevelSym(handle, "GetTimestampData");
+	funcSetFreqControlWordtoDDS = LowLevelSym(handle, "SetFreqControlWordtoDDS");
+	funcSetSelectExternelTrigger = LowLevelSym(handle, "SetSelectExternelTrigger");
+
+	RestoreSnapshot();
+	CalStoreInit(calFilePath);
+
+	/* pthread() posts to these as soon as it runs. */
+	scanIoInit(&TriginScanPvt);
+	scanIoInit(&ScalarinScanPvt);
+	scanIoInit(&TripBufferinScanPvt);
+	scanIoInit(&ADCrawBufferinScanPvt);
+	scanIoInit(&StatusinScanPvt);
+	scanIoInit(&SpecinScanPvt);
+	for(i=0; i<demand_offset_num; i++)
+		scanIoInit(&wfScanPvt[i]);
+	adcRingFixed = 1;
+	if(adcRingPulses > 0)
+	{
+		adcRing = malloc((size_t)adcRingPulses * adc_channel_num * adc_buf_len * sizeof(float));
+		adcStamp = calloc(adcRingPulses, sizeof(epicsTimeStamp));
+		if(adcRing == NULL || adcStamp == NULL)
+		{
+			DrvLog(DRVLOG_ERROR, "Can't allocate the raw ADC ring of %d pulses.\n", adcRingPulses);
+			free(adcRing);
+			adcRing = NULL;
+			adcRingPulses = 0;
+		}
+		else	// touch every page now, not on the first capture
+			memset(adcRing, 0, (size_t)adcRingPulses * adc_channel_num * adc_buf_len * sizeof(float));
+	}
+	trigPool = FrameBufPoolCreate(buf_len, frame_channel_num * 3);
+	histPool = FrameBufPoolCreate(trip_buf_len, 0);
+	for(i=0; i<frame_channel_num; i++)
+	{
+		pthread_mutex_init(&chanLock[i], NULL);
+		scanIoInit(&chanScanPvt[i]);
+		chanWf[i] = FrameBufTake(trigPool);
+		if(chanWf[i] == NULL)
+		{
+			printf("allocate frame buffers error!\n");
+			return -1;
+		}
+		memset(chanWf[i], 0, buf_len * sizeof(float));
+	}
+	for(i=0; i<poolSize; i++)
+	{
+		if(CreateRtThread(PoolWorker, poolPriority, poolCpusSet, &poolCpus) < 0)
+		{
+			printf("create worker thread error!\n");
+			poolSize = i;
+			break;
+		}
+	}
+
+	if(CreateAcqThread() != 0)
 	{
 		printf("create thread1 error!\n");
 		return -1;
 	}
-	
-	scanIoInit(&TriginScanPvt);
-	scanIoInit(&TripBufferinScanPvt);
-	scanIoInit(&ADCrawBufferinScanPvt);
+
+	pthread_t tidp2;
+	if(pthread_create(&tidp2, NULL, SnapshotThread, NULL) != 0)
+	{
+		printf("create snapshot thread error!\n");
+	}
+	if(pthread_create(&tidp2, NULL, StatusPollThread, NULL) != 0
+		|| pthread_create(&tidp2, NULL, HistoryCaptureThread, NULL) != 0)
+	{
+		printf("create history capture thread error!\n");
+	}
+	if(pthread_create(&tidp2, NULL, SpectrumThread, NULL) != 0)
+	{
+		printf("create spectrum thread error!\n");
+	}
 	
 	return 0;
 }
@@ -341,14 +854,129 @@ static int HistoryDataUploadReady(void);
 
 static void GetHistoryDataFromSingleCh(int channel,float *data);
 
-static void  ReadCSVparametersfile(int value);
-
 static void SetOffset(int row, double value);
 
-static void GetSysTime(void);
+static void SetProcConfig(int offset, int value);
+
+static int ValidateProcConfig(const procConfig_t *cfg, int length);
+
+static void LatchProcConfig(void);
+
+static void GetFrameConfig(procConfig_t *cfg);
+
+static void ReadFrameTime(epicsTimeStamp *stamp);
+
+static void LatchFrameTime(const epicsTimeStamp *stamp);
+
+static void BeginFrameUpdate(void);
+
+static void EndFrameUpdate(void);
+
+static float WindowAverage(const float *data, int length);
+
+static int GateFrame(const epicsTimeStamp *stamp);
+
+static void SetFrameGate(int offset, float value);
+
+static void InterlockPreview(void);
+
+static void ProcessFrame(int post);
+
+static void ComputeSoftXY(void);
+
+static void CorrectPositions(void);
+
+static const float *FrameXY(int i);
+
+static float UpdateBaseline(unsigned int k, const float *wfBuf, int length);
+
+static void IntegrateCharge(void);
+
+static void SetIntegration(int offset, int channel, float value);
+
+static void AverageFrame(void);
+
+static void SetAverage(int offset, float value);
+
+static void CopyAverage(unsigned int k, float *data, unsigned int nelem);
+
+static void CorrelateBPMs(void);
+
+static void SetCorrelation(int offset, float value);
+
+static int CaptureHistory(unsigned int cause, const epicsTimeStamp *stamp, const struct timespec *mono);
+
+static unsigned int ReadStatusWord(unsigned int last, int slow);
+
+static void ReadWRTime(int ch, epicsTimeStamp *stamp);
+
+static void CopyStatusRing(int offset, float *data, unsigned int nelem, epicsTimeStamp *stamp);
+
+static int IsHistoryWaveform(int offset);
+
+static int HistoryChannel(int offset);
+
+static void LoadHistoryBuffers(int enable);
+
+static void WaveformStamp(int offset, long long *TAI_S, int *TAI_nS);
+
+static unsigned int FrameChannelIndex(int offset);
+
+static float *RefWaveform(int offset, unsigned int *nelem);
+
+static int WaveformScale(int offset, double *slope, double *eoff);
+
+static int CopyChannel(int offset, float *data, unsigned int nelem);
+
+static int WaveformDue(void);
+
+static int OffsetWanted(int offset);
+
+static void PostTrigWaveforms(void);
+
+static void UpdateDemand(void);
+
+static void PostChannel(unsigned int k);
+
+static int CaptureADC(const epicsTimeStamp *stamp, int gated);
+
+static void FeedSpectrum(const epicsTimeStamp *stamp, int slot);
+
+static void SetADCCapture(int offset, float value);
+
+static int CopyADCRing(int ch, float *data, unsigned int nelem, epicsTimeStamp *stamp);
+
+static float GetSpectrum(int offset, int ch);
+
+static void SetSpectrum(int offset, float value);
+
+static void SetWaveformRate(int offset, float value);
+
+static float GetPreview(int type, int index);
+
+static int ProcConfigPendingValid(void);
+
+static int WindowPoints(int *start, int *stop, int length);
+
+static void ApplyReg(int offset, int channel, float val);
+
+static int IsShadowedReg(int offset);
+
+static int VerifyReg(int offset, int channel, float val);
+
+static int IsCalibrationReg(int offset);
+
+static void BeginCalTransaction(void);
+
+static void CommitCalTransaction(void);
+
+static void AbortCalTransaction(void);
+
 
 // static void copyArray(float *dmaBuf, float *wfBuf, int length);
 
+static void ReadTriggerData(int sel, int ch_N, float *data);
+
 static void copyArray(float *dmaBuf, float *wfBuf, int ch_N, int length);
 
 static void copyXYArray(float *dmaBuf, float *wfBuf, int ch_N, int length);
@@ -361,6 +989,10 @@ static void copyArray2Power(float *dmaBuf, float *wfBuf, int length, int Ch_N);
 
 static void copyPhArray(float *dmaBuf, float *wfBuf, int ch_N, int length);
 
+static void LatchFlattopPhase(const float *dmaBuf, int ch_N);
+
+static void LatchXYAvg(const float *wfBuf, int ch_N, int length);
+
 // static void copyADCrawData(int *dmaBuf, float *wfBuf, int length);
 
 /*-----------------------BPM function--------------------------*/
@@ -392,14 +1024,34 @@ static void SelectTriggerSource(int value);
 
 void *pthread()
 {
+	epicsTimeStamp stamp;
+	int post, gated, slot;
+	if(rtLockMemory)
+		PrefaultStack();
 	while(1)
 	{
 //		funcTriggerChannelDataReached();
 		funcTriggerAllDataReached();
-		scanIoRequest(TriginScanPvt);
-		funcGetTimestampData(1, &TAISecond, &TAINanoSecond);
+		ReadFrameTime(&stamp);
+		LatchProcConfig();
+		gated = GateFrame(&stamp);
+		if(gated)
+		{
+			BeginFrameUpdate();
+			LatchFrameTime(&stamp);
+			post = WaveformDue();
+			ProcessFrame(post);
+			EndFrameUpdate();
+			scanIoRequest(ScalarinScanPvt);
+			if(post)
+				PostTrigWaveforms();
+		}
+		slot = CaptureADC(&stamp, gated);
+		if(gated)
+			FeedSpectrum(&stamp, slot);
 		funcSetWRCaputureDataTrigger();
-		usleep(100000);
+		if(!ReplayFast())
+			AcqSleep(100000);
 //		GetTriggerData(rf1amp,rf1phase,rf2amp,rf2phase,rf3amp,rf3phase,rf4amp,rf4phase,rf5amp,rf5phase,rf6amp,rf6phase,rf7amp,rf7phase,rf8amp,rf8phase);
 //		GetTriggerAdcData(ADC1_rawdata, ADC2_rawdata, ADC3_rawdata, ADC4_rawdata, ADC5_rawdata, ADC6_rawdata, ADC7_rawdata, ADC8_rawdata);
 		// usleep(200000);
@@ -413,6 +1065,65 @@ IOSCANPVT devGetInTrigScanPvt()
 	return TriginScanPvt;
 }
 
+/* Called once from device support, the hook reports the monitors of each
+   waveform offset through SetWaveformDemand(). */
+void SetDemandHook(void (*hook)(void))
+{
+	demandHook = hook;
+}
+
+void SetWaveformDemand(int offset, int records, int monitors)
+{
+	if(offset < 0 || offset >= demand_offset_num)
+		return;
+	wfHasRecords[offset] = (records > 0);
+	__atomic_store_n(&wfDemand[offset], (monitors > 0xffff) ? 0xffff : monitors, __ATOMIC_RELAXED);
+}
+
+/* Waveforms of a processed channel have their own list, the other trigger
+   waveforms one per offset. */
+IOSCANPVT devGetInTrigChannelScanPvt(int offset)
+{
+	unsigned int i;
+	for(i=0; i<frame_channel_num; i++)
+	{
+		if(frameChannels[i] == offset)
+			return chanScanPvt[i];
+	}
+	if(offset == 123 || offset == 124)
+		return StatusinScanPvt;
+	if(offset >= 133 && offset <= 140)
+		return SpecinScanPvt;
+	if(offset >= 0 && offset < demand_offset_num)
+		return wfScanPvt[offset];
+	return TriginScanPvt;
+}
+
+IOSCANPVT devGetInScalarScanPvt()
+{
+	return ScalarinScanPvt;
+}
+
+/* Status bits are scanned by the poller on an edge, the spectral figures of
+   merit by SpectrumThread(), other scalars per frame. */
+IOSCANPVT devGetInScalarChannelScanPvt(int offset)
+{
+	if(offset >= 97 && offset <= 104)
+		return SpecinScanPvt;
+	return (offset == 82) ? StatusinScanPvt : ScalarinScanPvt;
+}
+
+/* Time of the last edge of a status bit. Returns -1 for other records. */
+int GetStatusTime(int offset, int channel, epicsTimeStamp *stamp)
+{
+	if(offset != 82 || channel < 0 || channel >= status_bit_num)
+		return -1;
+	pthread_mutex_lock(&statusLock);
+	*stamp = statusTime[channel];
+	pthread_mutex_unlock(&statusLock);
+	return 0;
+}
+
 IOSCANPVT devGetInTripBufferScanPvt()
 {
 	return TripBufferinScanPvt;
@@ -425,6 +1136,12 @@ IOSCANPVT devGetInADCrawBufferScanPvt()
 
 float ReadData(int offset, int channel, int type)
 {
+	procConfig_t cfg;
+	float val;
+	unsigned int u, v;
+	int state;
+	double slope, eoff;
+	GetFrameConfig(&cfg);
 	switch(offset)
 	{
 		case 0:
@@ -463,7 +1180,7 @@ float ReadData(int offset, int channel, int type)
 			return GetVabcdValue(channel);
 		case 6:
 //			return funcGetBPMPhaseValue(channel);
-			if(pulseMode==0)
+			if(cfg.pulseMode==0)
 //					return GetRFInfo(channel, 1);  //Return phase value.
 				return funcGetBPMPhaseValue(channel-2);	
 			else{
@@ -525,7 +1242,7 @@ float ReadData(int offset, int channel, int type)
 		case 28:
 			return (((float)(GetVabcdValue(5) - GetVabcdValue(7)) / 1.28E+6) * sqrt(2));
 		case 29:
-			if(pulseMode==0)
+			if(cfg.pulseMode==0)
 				return ((float)GetXYPosition(channel)/1E+6);
 			else
 			{
@@ -543,14 +1260,14 @@ float ReadData(int offset, int channel, int type)
 		case 31:
 			return funcGetSumProtect(channel);
 		case 32:
-			if(pulseMode==0)
+			if(cfg.pulseMode==0)
 				return (funcGetBPMPhaseValue(1)+funcGetBPMPhaseValue(2)+funcGetBPMPhaseValue(3))/3;
 			else
 			{
 				return ((ph_ch4+ph_ch5+ph_ch6)/3);
 			}
 		case 33:
-			if(pulseMode==0)
+			if(cfg.pulseMode==0)
 				return (funcGetBPMPhaseValue(5)+funcGetBPMPhaseValue(6)+funcGetBPMPhaseValue(7))/3;
 			else
 			{
@@ -570,10 +1287,199 @@ float ReadData(int offset, int channel, int type)
 
 
 			}
+		case 35:
+			return cfg.epoch;
+		case 36:
+			return ProcConfigPendingValid();
+		case 37:
+			return calTransaction;
+		case 38:
+			return calStagedWrites;
+		case 39:
+			return regWritesSkipped;
+		case 40:
+			return regWritesApplied;
+		case 41:
+			return iocStartupTime;
+		case 42:
+			return snapshotRestoreTime;
+		case 43:
+			return snapshotRestored;
+		case 44:
+			return CalStoreVersion();
+		case 45:
+			return CalStoreRows();
+		case 46:
+			return CalStoreLoadErrors();
+		case 47:
+			return DrvLogGetLevel();
+		case 48:
+			return DrvLogDropped();
+		case 49:
+			return DrvLogSuppressed();
+		case 50:
+			return GetFrameTime(NULL) & 0xffffff;	// stays exact in a float
+		case 51:
+		case 52:
+		case 53:
+			return GetPreview(offset, channel);
+		case 54:
+			return wfPosted & 0xffffff;
+		case 55:
+			return framesDuplicate & 0xffffff;
+		case 56:
+			return framesNoBeam & 0xffffff;
+		case 57:
+			return framesPublished & 0xffffff;
+		case 58:
+			return beamPresent;
+		case 59:
+			return jitterLast;
+		case 60:
+			return jitterMax;
+		case 61:
+			return rtActive;
+		case 62:
+			return procTimeLast;
+		case 63:
+			return procTimeMax;
+		case 64:
+			return poolSize;
+		case 65:
+			if(channel < 0 || channel > 3)
+				return 0;
+			pthread_mutex_lock(&softLock);
+			val = softRms[channel];
+			pthread_mutex_unlock(&softLock);
+			return val;
+		case 66:
+			return PosMapEnabled(channel) ? PosMapType(channel) : POSMAP_NONE;
+		case 67:
+			return mapTimeLast;
+		case 68:
+			if(channel < 0 || channel >= 2*charge_gate_num)
+				return 0;
+			pthread_mutex_lock(&chargeLock);
+			val = charge[channel/charge_gate_num][channel%charge_gate_num];
+			pthread_mutex_unlock(&chargeLock);
+			return val;
+		case 69:
+			if(channel < 0 || channel > 1)
+				return 0;
+			pthread_mutex_lock(&chargeLock);
+			val = charge[channel][0] + charge[channel][1] + charge[channel][2] + charge[channel][3];
+			pthread_mutex_unlock(&chargeLock);
+			return val;
+		case 70:
+			if(channel < 0 || channel > 7)
+				return 0;
+			pthread_mutex_lock(&chanLock[channel]);
+			val = baseline[channel];
+			pthread_mutex_unlock(&chanLock[channel]);
+			return val;
+		case 71:
+			pthread_mutex_lock(&avgLock);
+			val = avgCount;
+			pthread_mutex_unlock(&avgLock);
+			return val;
+		case 72:
+			return avgTimeLast;
+		case 82:
+			if(channel < 0 || channel >= status_bit_num)
+				return 0;
+			pthread_mutex_lock(&statusLock);
+			val = (statusWord >> channel) & 1;
+			pthread_mutex_unlock(&statusLock);
+			return val;
+		case 83:
+			pthread_mutex_lock(&statusLock);
+			val = statusEvents;
+			pthread_mutex_unlock(&statusLock);
+			return val;
+		case 84:
+			return pollTimeLast;
+		case 85:
+		case 86:
+			FrameBufStats((channel == 0) ? trigPool : histPool, &u, &v);
+			return (offset == 85) ? u : v;
+		case 109:
+			return __atomic_load_n(&framesDropped, __ATOMIC_RELAXED) & 0xffffff;
+		case 110:
+			return regReadbackErrors;
+		case 87:
+		case 88:
+			if(WaveformScale(channel, &slope, &eoff) != 0)
+				return 0;
+			return (offset == 87) ? slope : eoff;
+		case 97: case 98: case 99: case 100:
+		case 101: case 102: case 103: case 104:
+		case 105:
+		case 106:
+			return GetSpectrum(offset, channel);
+		case 107:
+		case 108:
+			ReplayStats(&u, &state);
+			return (offset == 107) ? u : state;
+		case 92:
+		case 94:
+		case 95:
+		case 96:
+			pthread_mutex_lock(&adcLock);
+			if(offset == 92)
+				val = adcState;
+			else if(offset == 94)
+				val = adcCaptured;
+			else if(offset == 95)
+				val = adcTimeLast;
+			else
+				val = adcCaptures & 0xffffff;
+			pthread_mutex_unlock(&adcLock);
+			return val;
+		case 89:
+			if(channel >= demand_offset_num)
+				return 0;
+			return __atomic_load_n(&wfDemand[channel], __ATOMIC_RELAXED);
+		case 90:
+			return __atomic_load_n(&scansPosted, __ATOMIC_RELAXED) & 0xffffff;
+		case 91:
+			return __atomic_load_n(&scansSkipped, __ATOMIC_RELAXED) & 0xffffff;
+		case 77:
+		case 78:
+		case 79:
+		case 80:
+		case 81:
+			pthread_mutex_lock(&tripLock);
+			if(offset == 77)
+				val = historyCause;
+			else if(offset == 78)
+				val = tripCount;
+			else if(offset == 79)
+				val = tripsMissed;
+			else if(offset == 80)
+				val = captureLatency;
+			else
+				val = publishLatency;
+			pthread_mutex_unlock(&tripLock);
+			return val;
+		case 73:
+		case 74:
+		case 75:
+		case 76:
+			pthread_mutex_lock(&corrLock);
+			if(offset == 73)
+				val = phaseDiff;
+			else if(offset == 74)
+				val = tofTotal;
+			else if(offset == 75)
+				val = tofDelta;
+			else
+				val = energyDev;
+			pthread_mutex_unlock(&corrLock);
+			return val;
 		case 93:
 			return funcGetWRStatus(channel);
 		default:
-			printf("Call ReadData function with Unknown offset value.\n");
+			DrvLog(DRVLOG_WARN, "Call ReadData function with Unknown offset value %d.\n", offset);
 			return 0;
 			break;
 	}
@@ -582,9 +1488,7 @@ float ReadData(int offset, int channel, int type)
 double amp2power(float amp, int ch_N)
 {
 	double dBm=0,power=0,offset=0,a=0,b=0,n=0,Vrms=0;
-	Getparameters(ch_N,1,&offset);
-	Getparameters(ch_N,2,&a);
-	Getparameters(ch_N,3,&b);
+	CalStoreGetPower(ch_N, &offset, &a, &b);
 	if(amp<=0)	amp=0;
 	else if(amp>=32767)	amp=32767;
 	Vrms=a*amp - b;  //This formula was decided by the calibration data.
@@ -595,6 +1499,67 @@ double amp2power(float amp, int ch_N)
 }
 
 void SetReg(int offset, int channel, float val)
+{
+	shadowReg_t *reg;
+	switch(offset)
+	{
+		case 29:
+			if((int)val == 1)
+				BeginCalTransaction();
+			else
+				CommitCalTransaction();
+			return;
+		case 30:
+			if((int)val == 1)
+				AbortCalTransaction();
+			return;
+	}
+	if(!IsShadowedReg(offset) || channel < 0 || channel >= shadow_ch_num)
+	{
+		ApplyReg(offset, channel, val);
+		VerifyReg(offset, channel, val);
+		return;
+	}
+	pthread_mutex_lock(&hwLock);
+	reg = &shadowRegs[offset][channel];
+	if(calTransaction && IsCalibrationReg(offset))
+	{
+		if(!reg->dirty)
+			calStagedWrites++;
+		reg->staged = val;
+		reg->dirty = 1;
+	}
+	else if(reg->valid && reg->value == val)
+	{
+		regWritesSkipped++;
+	}
+	else
+	{
+		ApplyReg(offset, channel, val);
+		reg->value = val;
+		reg->valid = (VerifyReg(offset, channel, val) == 0);
+		regWritesApplied++;
+		MarkSnapshotDirty();
+	}
+	pthread_mutex_unlock(&hwLock);
+}
+
+int GetRestoredReg(int offset, int channel, float *val)
+{
+	int status = -1;
+	if(offset < 0 || offset >= shadow_reg_num || channel < 0 || channel >= shadow_ch_num)
+		return -1;
+	pthread_mutex_lock(&hwLock);
+	if(shadowRegs[offset][channel].valid)
+	{
+		*val = shadowRegs[offset][channel].value;
+		status = 0;
+	}
+	pthread_mutex_unlock(&hwLock);
+	return status;
+}
+
+static void ApplyReg(int offset, int channel, float val)
 {
 	int val_tmp;
 	val_tmp = (int)val;
@@ -684,13 +1649,9 @@ void SetReg(int offset, int channel, float val)
 			SetBPMSumLimits(channel, val_tmp);
 			break;
 		case 19:
-			pulseMode = val_tmp;
-			break;
 		case 20:
-			AVGStart = val_tmp;
-			break;
 		case 21:
-			AVGStop = val_tmp;
+			SetProcConfig(offset, val_tmp);
 			break;
 		case 22:
 			SetFastIntlkFilterTime(val);
@@ -708,137 +1669,272 @@ void SetReg(int offset, int channel, float val)
 			SelectTriggerSource(val_tmp);
 			break;
 		case 27:
-			BackGroundStart = val_tmp;
-			break;
 		case 28:
-			BackGroundStop = val_tmp;
-			break;
-		default:
-			printf("Call SetReg function with Unknown offset value.\n");	
-			break;
-	}
-}
-
-void readWaveform(int offset, int ch_N, unsigned int nelem, float* data, long long *TAI_S, int *TAI_nS)
-{
-	*TAI_S = (TAISecond-631152000-8*60*60);
-	*TAI_nS = (TAINanoSecond*16);
-	switch(offset)
-	{
-		case 1:
-			funcGetTriggerAllData(0, 0, data);
-//			*TAI_S = (TAISecond-631152000);
-//			*TAI_nS = (TAINanoSecond*16);
+			SetProcConfig(offset, val_tmp);
 			break;
-		case 2:
-			funcGetTriggerAllData(0, 1, data);
-//			*TAI_S = (TAISecond-631152000);
-//			*TAI_nS = (TAINanoSecond*16);
-			break;
-		case 3:
-			funcGetTriggerAllData(0, 2, data);
-			break;
-		case 4:
-			funcGetTriggerAllData(0, 3, data);
-			break;
-		case 5:
-			funcGetTriggerAllData(0, 4, data);
+		case 31:
+			DrvLogSetLevel(val_tmp);
 			break;
-		case 6:
-			funcGetTriggerAllData(0, 5, data);
+		case 32:
+		case 33:
+			SetWaveformRate(offset, val);
 			break;
-		case 7:
-			funcGetTriggerAllData(0, 6, data);
+		case 34:
+		case 35:
+			SetFrameGate(offset, val);
 			break;
-		case 8:
-			funcGetTriggerAllData(0, 7, data);
+		case 36:
+			if(val_tmp)
+				ResetJitter();
 			break;
-//		case 9:
-//			funcGetTriggerAllData(0, 8, data);
-//			break;
-//		case 10:
-//			funcGetTriggerAllData(0, 9, data);
-//			break;
-		case 11:
-			copyArray(rf3amp, data, 0, nelem);
-			calculateAvgVoltage(data,0,nelem);
-//			funcGetTriggerAllData(1, 0, data);
+		case 37:
+			PosMapEnable(channel, val_tmp);
 			break;
-		case 12:
-			copyArray(rf4amp, data, 2, nelem);
-			calculateAvgVoltage(data,2,nelem);
-//			funcGetTriggerAllData(1, 2, data);
+		case 38:
+		case 39:
+		case 40:
+		case 41:
+			SetIntegration(offset, channel, val);
 			break;
-		case 13:
-			copyArray(rf5amp, data, 4, nelem);
-			calculateAvgVoltage(data,4,nelem);
-//			funcGetTriggerAllData(1, 4, data);
+		case 42:
+		case 43:
+		case 44:
+			SetAverage(offset, val);
 			break;
-		case 14:
-			copyArray(rf6amp, data, 6, nelem);
-			calculateAvgVoltage(data,6,nelem);
-//			funcGetTriggerAllData(1, 6, data);
+		case 45:
+		case 46:
+		case 47:
+		case 48:
+		case 49:
+			SetCorrelation(offset, val);
 			break;
-		case 15:
-			copyArray(rf7amp, data, 8, nelem);
-			calculateAvgVoltage(data,8,nelem);
-//			funcGetTriggerAllData(1, 8, data);
+		case 50:
+			pthread_mutex_lock(&tripLock);
+			autoCapture = (val_tmp != 0);
+			pthread_mutex_unlock(&tripLock);
 			break;
-		case 16:
-			copyArray(rf8amp, data, 10, nelem);
-			calculateAvgVoltage(data,10,nelem);
-//			funcGetTriggerAllData(1, 10, data);
+		case 51:
+			pthread_mutex_lock(&tripLock);
+			watchPeriod = (val_tmp < status_min_period) ? status_min_period : val_tmp;
+			pthread_mutex_unlock(&tripLock);
 			break;
-		case 17:
-			copyArray(rf9amp, data, 12, nelem);
-			calculateAvgVoltage(data,12,nelem);
-//			funcGetTriggerAllData(1, 12, data);
+		case 52:
+			__atomic_store_n(&zeroCopy, val_tmp != 0, __ATOMIC_RELAXED);
+			if(val_tmp == 0)
+				LoadHistoryBuffers(0);
 			break;
-		case 18:
-			copyArray(rf10amp, data, 14, nelem);
-			calculateAvgVoltage(data,14,nelem);
-//			funcGetTriggerAllData(1, 14, data);
+		case 53:
+			__atomic_store_n(&demandDriven, val_tmp != 0, __ATOMIC_RELAXED);
 			break;
-//		case 19:
-//			copyArray(rf9amp, data, 16, nelem);
-//			funcGetTriggerAllData(1, 16, data);
-//			break;
-//		case 20:
-//			copyArray(rf10amp, data, 18, nelem);
-//			funcGetTriggerAllData(1, 18, data);
-//			break;
-		case 21:
-			copyPhArray(rf3phase, data, 1, nelem);
-//			funcGetTriggerAllData(1, 1, data);
+		case 54:
+		case 55:
+		case 56:
+		case 57:
+		case 58:
+		case 59:
+			SetADCCapture(offset, val);
 			break;
-		case 22:
-			copyPhArray(rf4phase, data, 3, nelem);
-//			funcGetTriggerAllData(1, 3, data);
+		case 60:
+		case 61:
+		case 62:
+		case 63:
+		case 64:
+			SetSpectrum(offset, val);
 			break;
-		case 23:
-//			funcGetTriggerAllData(1, 5, data);
-			copyPhArray(rf5phase, data, 5, nelem);
+		default:
+			DrvLog(DRVLOG_WARN, "Call SetReg function with Unknown offset value %d.\n", offset);
 			break;
-		case 24:
-//			funcGetTriggerAllData(1, 7, data);
-			copyPhArray(rf6phase, data, 7, nelem);
+	}
+}
+
+/* Time of the data of a waveform: the trip (or manual read) for the history
+   channels, the frame for the rest. */
+static void WaveformStamp(int offset, long long *TAI_S, int *TAI_nS)
+{
+	epicsTimeStamp stamp;
+	struct timespec now;
+	if(IsHistoryWaveform(offset))
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		pthread_mutex_lock(&tripLock);
+		stamp = historyStamp;
+		if(historyCause != 0)
+			publishLatency = ((now.tv_sec - historyMono.tv_sec) * 1E+9 + (now.tv_nsec - historyMono.tv_nsec)) / 1E+6;
+		pthread_mutex_unlock(&tripLock);
+	}
+	else
+		GetFrameTime(&stamp);
+	*TAI_S = stamp.secPastEpoch;
+	*TAI_nS = stamp.nsec;
+}
+
+/* A reference to the frame buffer holding the waveform, for the record to
+   point its BPTR at until it calls ReleaseWaveform(). NULL if zero-copy is off
+   or the waveform has no frame buffer, then readWaveform() copies it. */
+float *AcquireWaveform(int offset, int ch_N, unsigned int *nelem, long long *TAI_S, int *TAI_nS)
+{
+	float *wf;
+	if(!__atomic_load_n(&zeroCopy, __ATOMIC_RELAXED))
+		return NULL;
+	wf = RefWaveform(offset, nelem);
+	if(wf != NULL)
+		WaveformStamp(offset, TAI_S, TAI_nS);
+	return wf;
+}
+
+void ReleaseWaveform(float *data)
+{
+	FrameBufRelease(data);
+}
+
+/* A reference to the frame buffer of the waveform, NULL if it has none. */
+static float *RefWaveform(int offset, unsigned int *nelem)
+{
+	unsigned int k;
+	int ch;
+	float *wf = NULL;
+	ch = HistoryChannel(offset);
+	k = FrameChannelIndex(offset);
+	if(ch >= 0)
+	{
+		pthread_mutex_lock(&tripLock);
+		wf = historyWf[ch];
+		FrameBufRef(wf);
+		pthread_mutex_unlock(&tripLock);
+	}
+	else if(k < frame_channel_num)
+	{
+		pthread_mutex_lock(&chanLock[k]);
+		wf = chanWf[k];
+		FrameBufRef(wf);
+		pthread_mutex_unlock(&chanLock[k]);
+	}
+	if(wf != NULL)
+		*nelem = FrameBufLength(wf);
+	return wf;
+}
+
+/* Scale of the counts lowlevel hands back for a waveform, value = slope*count
+   + eoff. Returns -1 for waveforms computed in the IOC. */
+static int WaveformScale(int offset, double *slope, double *eoff)
+{
+	*eoff = 0;
+	if(offset >= 11 && offset <= 18)	// amplitude, as copyArray()
+		*slope = sqrt(2) / 1.28E+6;
+	else if((offset >= 61 && offset <= 64) || (offset >= 81 && offset <= 84))	// X/Y in um
+		*slope = 1E-3;
+	else if((offset >= 1 && offset <= 8) || (offset >= 21 && offset <= 28) || (offset >= 125 && offset <= 132)
+		|| offset == 65 || offset == 66 || IsHistoryWaveform(offset))
+		*slope = 1;
+	else
+		return -1;
+	return 0;
+}
+
+/* Counts of the waveform as width-byte integers (2 or 4), clipped to the
+   range. Returns the number of clipped samples, or -1 if the waveform has no
+   integer form. */
+int readWaveformCounts(int offset, int ch_N, unsigned int nelem, void *data, int width, long long *TAI_S, int *TAI_nS)
+{
+	double slope, eoff, inv, c;
+	double low = (width == 2) ? -32768 : -2147483648.0;
+	double high = (width == 2) ? 32767 : 2147483647.0;
+	float *src;
+	unsigned int i, n = 0;
+	int clipped = 0;
+	if(WaveformScale(offset, &slope, &eoff) != 0)
+		return -1;
+	inv = 1 / slope;
+	src = RefWaveform(offset, &n);
+	if(src != NULL)
+		WaveformStamp(offset, TAI_S, TAI_nS);
+	else
+	{
+		pthread_mutex_lock(&countsLock);
+		if(countsLen < nelem)
+		{
+			free(countsBuf);
+			countsBuf = malloc(nelem * sizeof(float));
+			countsLen = (countsBuf != NULL) ? nelem : 0;
+		}
+		if(countsBuf == NULL)
+		{
+			pthread_mutex_unlock(&countsLock);
+			return -1;
+		}
+		readWaveform(offset, ch_N, nelem, countsBuf, TAI_S, TAI_nS);
+		src = countsBuf;
+		n = nelem;
+	}
+	if(n > nelem)
+		n = nelem;
+	for(i=0; i<n; i++)
+	{
+		c = rint((src[i] - eoff) * inv);
+		if(c < low || c > high)
+		{
+			c = (c < low) ? low : high;
+			clipped++;
+		}
+		if(width == 2)
+			((int16_t *)data)[i] = (int16_t)c;
+		else
+			((int32_t *)data)[i] = (int32_t)c;
+	}
+	if(src == countsBuf)
+		pthread_mutex_unlock(&countsLock);
+	else
+		FrameBufRelease(src);
+	return clipped;
+}
+
+void readWaveform(int offset, int ch_N, unsigned int nelem, float* data, long long *TAI_S, int *TAI_nS)
+{
+	unsigned int i;
+	epicsTimeStamp stamp;
+	WaveformStamp(offset, TAI_S, TAI_nS);
+	if(CopyChannel(offset, data, nelem) == 0)
+		return;
+	switch(offset)
+	{
+		case 1:
+			ReadTriggerData(0, 0, data);
 			break;
-		case 25:
-//			funcGetTriggerAllData(1, 9, data);
-			copyPhArray(rf7phase, data, 9, nelem);
+		case 2:
+			ReadTriggerData(0, 1, data);
 			break;
-		case 26:
-//			funcGetTriggerAllData(1, 11, data);
-			copyPhArray(rf8phase, data, 11, nelem);
+		case 3:
+			ReadTriggerData(0, 2, data);
 			break;
-		case 27:
-//			funcGetTriggerAllData(1, 13, data);
-			copyPhArray(rf9phase, data, 13, nelem);
+		case 4:
+			ReadTriggerData(0, 3, data);
 			break;
-		case 28:
-//			funcGetTriggerAllData(1, 15, data);
-			copyPhArray(rf10phase, data, 15, nelem);
+		case 5:
+			ReadTriggerData(0, 4, data);
+			break;
+		case 6:
+			ReadTriggerData(0, 5, data);
+			break;
+		case 7:
+			ReadTriggerData(0, 6, data);
+			break;
+		case 8:
+			ReadTriggerData(0, 7, data);
 			break;
+//		case 9:
+//			funcGetTriggerAllData(0, 8, data);
+//			break;
+//		case 10:
+//			funcGetTriggerAllData(0, 9, data);
+//			break;
+//		case 19:
+//			copyArray(rf9amp, data, 16, nelem);
+//			funcGetTriggerAllData(1, 16, data);
+//			break;
+//		case 20:
+//			copyArray(rf10amp, data, 18, nelem);
+//			funcGetTriggerAllData(1, 18, data);
+//			break;
 //		case 29:
 //			funcGetTriggerAllData(1, 17, data);
 //			copyPhArray(rf9phase, data, 17, nelem);
@@ -931,24 +2027,6 @@ void readWaveform(int offset, int ch_N, unsigned int nelem, float* data, long lo
 //		case 60:
 //			copyArray(rf10amp, data, 18, nelem);
 //			break;
-		case 61:
-			copyXYArray(X1, data, 16, nelem);
-			break;
-		case 62:
-			copyXYArray(Y1, data, 17, nelem);
-			break;
-		case 63:
-			copyXYArray(X2, data, 18, nelem);
-			break;
-		case 64:
-			copyXYArray(Y2, data, 19, nelem);
-			break;
-		case 65:
-			funcGetTriggerAllData(1, 20, data);
-			break;
-		case 66:
-			funcGetTriggerAllData(1, 21, data);
-			break;
 //		case 73:
 //			copyHistoryArray(rf3amp_trip, data, 4, nelem);
 //			break;
@@ -991,17 +2069,151 @@ void readWaveform(int offset, int ch_N, unsigned int nelem, float* data, long lo
 		case 86:
 			GetHistoryDataFromSingleCh(21, data);
 			break;		
+		case 87:
+			for(i=0; i<nelem; i++)
+				data[i] = (i < jitter_bucket_num) ? jitterHist[i] : 0;
+			break;
+		case 88:
+		case 89:
+		case 90:
+		case 91:
+			if(nelem > buf_len)
+				nelem = buf_len;
+			pthread_mutex_lock(&softLock);
+			memcpy(data, softXY[offset-88], nelem * sizeof(float));
+			pthread_mutex_unlock(&softLock);
+			break;
+		case 92:
+		case 93:
+		case 94:
+		case 95:
+		case 96:
+		case 97:
+		case 98:
+		case 99:
+			if(nelem > buf_len)
+				nelem = buf_len;
+			pthread_mutex_lock(&chanLock[offset-92]);
+			memcpy(data, chanBase[offset-92], nelem * sizeof(float));
+			pthread_mutex_unlock(&chanLock[offset-92]);
+			break;
+		case 100: case 101: case 102: case 103: case 104: case 105:
+		case 106: case 107: case 108: case 109: case 110: case 111:
+		case 112: case 113: case 114: case 115: case 116: case 117:
+		case 118: case 119: case 120: case 121:
+			CopyAverage(offset-100, data, nelem);
+			break;
+		case 122:
+			if(nelem > buf_len)
+				nelem = buf_len;
+			pthread_mutex_lock(&corrLock);
+			memcpy(data, phaseDiffWf, nelem * sizeof(float));
+			pthread_mutex_unlock(&corrLock);
+			break;
+		case 133: case 134: case 135: case 136:
+		case 137: case 138: case 139: case 140:
+			if(nelem > spec_points)
+			{
+				memset(data + spec_points, 0, (nelem - spec_points) * sizeof(float));
+				nelem = spec_points;
+			}
+			pthread_mutex_lock(&specLock);
+			memcpy(data, specWf[offset-133], nelem * sizeof(float));
+			*TAI_S = specStamp[offset-133].secPastEpoch;
+			*TAI_nS = specStamp[offset-133].nsec;
+			pthread_mutex_unlock(&specLock);
+			break;
+		case 125: case 126: case 127: case 128:
+		case 129: case 130: case 131: case 132:
+			if(CopyADCRing(offset-125, data, nelem, &stamp) == 0)
+			{
+				*TAI_S = stamp.secPastEpoch;
+				*TAI_nS = stamp.nsec;
+			}
+			break;
+		case 123:
+		case 124:
+			stamp.secPastEpoch = *TAI_S;
+			stamp.nsec = *TAI_nS;
+			CopyStatusRing(offset, data, nelem, &stamp);
+			*TAI_S = stamp.secPastEpoch;
+			*TAI_nS = stamp.nsec;
+			break;
 		default:
-			printf("Call readWaveform function with Unknown offset value.\n");		
+			DrvLog(DRVLOG_WARN, "Call readWaveform function with Unknown offset value %d.\n", offset);
+			break;
+	}
+}
+
+/* Build the packed frame straight into the record buffer. If pthread() was
+   updating the frame, or moved on to the next one while the channels were
+   copied, build it again, so the header and every channel belong to one pulse.
+   After frame_read_tries attempts nothing is published. */
+int readFrameWaveform(void *buf, unsigned int maxBytes, unsigned int *nBytes, epicsTimeStamp *stamp)
+{
+	frameHeader_t *hdr = (frameHeader_t *)buf;
+	U32 *lengths = (U32 *)(hdr + 1);
+	float *data;
+	long long sec;
+	int nsec, tries;
+	unsigned int i, seq, update;
+	unsigned int headerBytes = sizeof(frameHeader_t) + frame_channel_num * sizeof(U32);
+	unsigned int totalBytes = headerBytes + frame_channel_num * buf_len * sizeof(float);
+
+	*nBytes = 0;
+	if(maxBytes < totalBytes)
+	{
+		DrvLog(DRVLOG_ERROR, "Frame waveform needs NELM >= %u, it has %u.\n", totalBytes, maxBytes);
+		return -1;
+	}
+	for(tries=0; tries<frame_read_tries; tries++)
+	{
+		update = __atomic_load_n(&frameUpdateSeq, __ATOMIC_ACQUIRE);
+		if(update & 1)
+		{
+			usleep(1000);
+			continue;
+		}
+		seq = GetFrameTime(stamp);
+		data = (float *)((char *)buf + headerBytes);
+		for(i=0; i<frame_channel_num; i++)
+		{
+			readWaveform(frameChannels[i], 0, buf_len, data, &sec, &nsec);
+			lengths[i] = buf_len;
+			data += buf_len;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&frameUpdateSeq, __ATOMIC_RELAXED) == update)
 			break;
 	}
+	if(tries == frame_read_tries)
+	{
+		DrvLog(DRVLOG_WARN, "Frame waveform not built, the frame changed on each of %d attempts.\n", frame_read_tries);
+		return -1;
+	}
+	hdr->magic = frame_magic;
+	hdr->version = frame_version;
+	hdr->headerBytes = headerBytes;
+	hdr->secPastEpoch = stamp->secPastEpoch;
+	hdr->nsec = stamp->nsec;
+	hdr->seq = seq;
+	hdr->nChannels = frame_channel_num;
+	*nBytes = totalBytes;
+	return 0;
+}
+
+static void ReadTriggerData(int sel, int ch_N, float *data)
+{
+	pthread_mutex_lock(&dmaLock);
+	funcGetTriggerAllData(sel, ch_N, data);
+	pthread_mutex_unlock(&dmaLock);
 }
 
 static void copyArray(float *dmaBuf, float *wfBuf, int ch_N, int length)
 {
 	int i;
 //	funcGetTriggerChannelData(ch_N, dmaBuf);
-	funcGetTriggerAllData(1, ch_N, dmaBuf);
+	ReadTriggerData(1, ch_N, dmaBuf);
 	for(i=0; i<length; ++i){
 		wfBuf[i] = ((float)dmaBuf[i] / 1.28E+6) * sqrt(2);
 	}
@@ -1010,61 +2222,83 @@ static void copyArray(float *dmaBuf, float *wfBuf, int ch_N, int length)
 static void copyPhArray(float *dmaBuf, float *wfBuf, int ch_N, int length)
 {
 	int i;
-	funcGetTriggerAllData(1, ch_N, dmaBuf);
+	ReadTriggerData(1, ch_N, dmaBuf);
 	for(i=0; i<length; ++i){
 		wfBuf[i] = (float)dmaBuf[i];
-		if(i==AVGStop){
-			if(ch_N == 1){
-				ph_ch3 = (float)dmaBuf[i];
-			}
-			else if(ch_N == 3){
-				ph_ch4 = (float)dmaBuf[i];
-			}
-			else if(ch_N == 5){
-				ph_ch5 = (float)dmaBuf[i];
-			}
-			else if(ch_N == 7){
-				ph_ch6 = (float)dmaBuf[i];
-			}
-			else if(ch_N == 9){
-				ph_ch7 = (float)dmaBuf[i];
-			}
-			else if(ch_N == 11){
-				ph_ch8 = (float)dmaBuf[i];
-			}
-			else if(ch_N == 13){
-				ph_ch9 = (float)dmaBuf[i];
-			}
-			else if(ch_N == 15){
-				ph_ch10 = (float)dmaBuf[i];
-			}
-		}
+	}
+}
+
+/* Phase at the end of the average window, used in pulse mode. */
+static void LatchFlattopPhase(const float *dmaBuf, int ch_N)
+{
+	int i;
+	procConfig_t cfg;
+	GetFrameConfig(&cfg);
+	i = cfg.AVGStop;
+	if(i < 0 || i >= buf_len)
+		return;
+	if(ch_N == 1){
+		ph_ch3 = (float)dmaBuf[i];
+	}
+	else if(ch_N == 3){
+		ph_ch4 = (float)dmaBuf[i];
+	}
+	else if(ch_N == 5){
+		ph_ch5 = (float)dmaBuf[i];
+	}
+	else if(ch_N == 7){
+		ph_ch6 = (float)dmaBuf[i];
+	}
+	else if(ch_N == 9){
+		ph_ch7 = (float)dmaBuf[i];
+	}
+	else if(ch_N == 11){
+		ph_ch8 = (float)dmaBuf[i];
+	}
+	else if(ch_N == 13){
+		ph_ch9 = (float)dmaBuf[i];
+	}
+	else if(ch_N == 15){
+		ph_ch10 = (float)dmaBuf[i];
 	}
 }
 
 static void copyXYArray(float *dmaBuf, float *wfBuf, int ch_N, int length)
 {
 	int i;
-	float sum=0;
-	int totalPoints;
 //	funcGetTriggerChannelData(ch_N, dmaBuf);
-	funcGetTriggerAllData(1, ch_N, dmaBuf);
+	ReadTriggerData(1, ch_N, dmaBuf);
 	for(i=0; i<length; ++i){
 		wfBuf[i] = ((float)dmaBuf[i] / 1000);
-		if(i>=AVGStart && i<=AVGStop)
-		{
-			sum += ((float)dmaBuf[i] / 1000);
-		}
 	}
-	totalPoints = AVGStop - AVGStart + 1;
+}
+
+/* X/Y average over the average window of the converted waveform, used in
+   pulse mode. */
+static void LatchXYAvg(const float *wfBuf, int ch_N, int length)
+{
+	int i;
+	float sum=0;
+	float avg=0;
+	int start, stop, totalPoints;
+	procConfig_t cfg;
+	GetFrameConfig(&cfg);
+	start = cfg.AVGStart;
+	stop = cfg.AVGStop;
+	totalPoints = WindowPoints(&start, &stop, length);
+	for(i=start; i<=stop && totalPoints>0; ++i){
+		sum += wfBuf[i];
+	}
+	if(totalPoints > 0)
+		avg = sum/totalPoints;
 	if(ch_N == 16)
-		X1_avg = sum/totalPoints;
-    else if(ch_N == 17)
-		Y1_avg = sum/totalPoints;
+		X1_avg = avg;
+	else if(ch_N == 17)
+		Y1_avg = avg;
 	else if(ch_N == 18)
-		X2_avg = sum/totalPoints;
+		X2_avg = avg;
 	else if(ch_N == 19)
-		Y2_avg = sum/totalPoints;
+		Y2_avg = avg;
 }
 
 static void copyHistoryArray(float *dmaBuf, float *wfBuf, int ch_N, int length)
@@ -1099,9 +2333,7 @@ static void copyArray2Power(float *dmaBuf, float *wfBuf, int length, int Ch_N)
 {
 	double dBm=0,power=0,offset=0,a=0,b=0,n=0,amp=0,Vrms=0;
 	int i;
-	Getparameters(Ch_N,1,&offset);
-	Getparameters(Ch_N,2,&a);
-	Getparameters(Ch_N,3,&b);
+	CalStoreGetPower(Ch_N, &offset, &a, &b);
 	for(i=0; i<length; ++i){
 		amp = (double)dmaBuf[i];
 		Vrms=a*amp - b;
@@ -1155,10 +2387,9 @@ static float GetDI(int channel)
 
 static void SetDO(int channel, int value)
 {
-	GetSysTime();
-	printf("Set DO %d value to %d\n", channel, value);
+	DrvLog(DRVLOG_INFO, "Set DO %d value to %d\n", channel, value);
 	funcSetDO(channel, value);
-	printf("Set DO finished!\n");
+	DrvLog(DRVLOG_DEBUG, "Set DO finished!\n");
 }
 
 static float GetFPGA_LED0_RBK()
@@ -1177,29 +2408,25 @@ static float GetFPGA_LED1_RBK()
 
 static void SetSysLedEnable(int enable)
 {
-	GetSysTime();
-	printf("Set Sys LED on front panel enable --> %d\n", enable);
+	DrvLog(DRVLOG_INFO, "Set Sys LED on front panel enable --> %d\n", enable);
 	funcSetArmLedEnable(enable);	
 }
 
 static void SetFanLedStat(int value)
 {
-	GetSysTime();
-	printf("Set Fan LED state on front panel to --> %d\n", value);
+	DrvLog(DRVLOG_INFO, "Set Fan LED state on front panel to --> %d\n", value);
 	funcSetFanLedStatus(value);
 }
 
 static void SetPulsecw(unsigned short value)
 {
-	GetSysTime();
-	printf("Set Pulse CW --> %d\n", value);
+	DrvLog(DRVLOG_INFO, "Set Pulse CW --> %d\n", value);
 	funcSetOutputPulseEnable(value);
 }
 
 static void  SetInnerTrigEn(int value)
 {
-	GetSysTime();
-	printf("Select Inner or external Trig signal to collect Trigger waveform --> %d\n", value);
+	DrvLog(DRVLOG_INFO, "Select Inner or external Trig signal to collect Trigger waveform --> %d\n", value);
 	funcSetInnerTrigEn(value);
 }
 
@@ -1212,75 +2439,296 @@ static float   GetHistoryDataReady()
 
 static int SetHistoryTrigger(int enable)
 {
-	GetSysTime();
-	printf("IOC try to read History waveform.\n");	
-//	printf("Set History Trigger to 1\n");	
-//	printf("History Trigger have set to -->%d\n", enable);
-//	historyDataFlag = HistoryDataUploadReady();
-	if(enable == 1 && ReadWfActionCounter == 0)
-	{
-		ReadWfActionCounter = 1;		
-		funcSetHistoryTrigger(enable);
-		GetSysTime();
-		printf("finish setting history waveform trigger method --> %d!\n", enable);
-//		printf("Begin Get History data!\n");
-		// rf1amp_trip = malloc(trip_buf_len * sizeof(float));
-		// rf2amp_trip = malloc(trip_buf_len * sizeof(float));
-		// rf3amp_trip = malloc(trip_buf_len * sizeof(float));
-		// rf4amp_trip = malloc(trip_buf_len * sizeof(float));
-		// rf5amp_trip = malloc(trip_buf_len * sizeof(float));
-		// rf6amp_trip = malloc(trip_buf_len * sizeof(float));
-		// rf7amp_trip = malloc(trip_buf_len * sizeof(float));
-		// rf8amp_trip = malloc(trip_buf_len * sizeof(float));
-		// rf1phase_trip = malloc(trip_buf_len * sizeof(float));
-		// rf2phase_trip = malloc(trip_buf_len * sizeof(float));
-		// rf3phase_trip = malloc(trip_buf_len * sizeof(float));
-		// rf4phase_trip = malloc(trip_buf_len * sizeof(float));
-		// rf5phase_trip = malloc(trip_buf_len * sizeof(float));
-		// rf6phase_trip = malloc(trip_buf_len * sizeof(float));
-		// rf7phase_trip = malloc(trip_buf_len * sizeof(float));
-		// rf8phase_trip = malloc(trip_buf_len * sizeof(float));
-		GetSysTime();
-		printf("Start to Get History data!\n");
-//		int historyDataReady=0;
-//		historyDataReady = HistoryDataUploadReady();
-		HistoryDataUploadReady();
-		// while(historyDataReady == 1 && historyDataFlag == 0)
-		// {
-			// historyDataReady = HistoryDataUploadReady();
-			// usleep(100000);
-		// } 
-//		GetHistoryData(rf1amp_trip,rf1phase_trip,rf2amp_trip,rf2phase_trip,rf3amp_trip,rf3phase_trip,rf4amp_trip,rf4phase_trip,rf5amp_trip,rf5phase_trip,rf6amp_trip,rf6phase_trip,rf7amp_trip,rf7phase_trip,rf8amp_trip,rf8phase_trip);
-		scanIoRequest(TripBufferinScanPvt);
-		ReadWfActionCounter = 0;
-		GetSysTime();
-		printf("All history data have been read from FPGA and stored in ARM buffer.\n");
-		return 0;
+	epicsTimeStamp stamp;
+	struct timespec mono;
+	DrvLog(DRVLOG_INFO, "IOC try to read History waveform.\n");	
+	if(enable == 1)
+	{
+		epicsTimeGetCurrent(&stamp);
+		clock_gettime(CLOCK_MONOTONIC, &mono);
+		if(CaptureHistory(0, &stamp, &mono) == 0)
+			return 0;
 	}
-	GetSysTime();
-	printf("The last run of read History waveform didn't finish or the read command value is 0, exit.\n");
+	DrvLog(DRVLOG_INFO, "The last run of read History waveform didn't finish or the read command value is 0, exit.\n");
 	return 1;
 }
 
+/* Freeze the history storage, wait until it is uploaded and post the history
+   waveforms. cause is 0 for a manual read. Returns 1 if a read is running. */
+static int CaptureHistory(unsigned int cause, const epicsTimeStamp *stamp, const struct timespec *mono)
+{
+	struct timespec now;
+	pthread_mutex_lock(&historyLock);
+	if(ReadWfActionCounter != 0)
+	{
+		pthread_mutex_unlock(&historyLock);
+		return 1;
+	}
+	ReadWfActionCounter = 1;
+	funcSetHistoryTrigger(1);
+	DrvLog(DRVLOG_INFO, "finish setting history waveform trigger method --> %d!\n", 1);
+	DrvLog(DRVLOG_INFO, "Start to Get History data!\n");
+	HistoryDataUploadReady();
+	LoadHistoryBuffers(__atomic_load_n(&zeroCopy, __ATOMIC_RELAXED));
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&tripLock);
+	historyStamp = *stamp;
+	historyMono = *mono;
+	historyCause = cause;
+	if(cause != 0)
+	{
+		captureLatency = ((now.tv_sec - mono->tv_sec) * 1E+9 + (now.tv_nsec - mono->tv_nsec)) / 1E+6;
+		publishLatency = 0;
+	}
+	pthread_mutex_unlock(&tripLock);
+	scanIoRequest(TripBufferinScanPvt);
+	ReadWfActionCounter = 0;
+	pthread_mutex_unlock(&historyLock);
+	DrvLog(DRVLOG_INFO, "All history data have been read from FPGA and stored in ARM buffer.\n");
+	return 0;
+}
+
+/* The trip bits; the WR status bits only with slow, else as in last. */
+static unsigned int ReadStatusWord(unsigned int last, int slow)
+{
+	unsigned int state = 0;
+	int ch;
+	for(ch=0; ch<4; ch++)
+	{
+		if(funcGetxyProtect(ch))
+			state |= 1 << ch;
+	}
+	for(ch=0; ch<3; ch++)
+	{
+		if(funcGetSumProtect(ch))
+			state |= 1 << (4 + ch);
+	}
+	if(funcGetADclkState())
+		state |= trip_cause_clock;
+	if(!slow)
+		return state | (last & ~trip_mask);
+	for(ch=0; ch<2; ch++)
+	{
+		if(funcGetWRStatus(ch))
+			state |= 1 << (8 + ch);
+	}
+	return state;
+}
+
+/* WR time, ch 0 now, ch 1 the capture of the last trigger frame. */
+static void ReadWRTime(int ch, epicsTimeStamp *stamp)
+{
+	long long sec=0;
+	int tick=0;
+	funcGetTimestampData(ch, &sec, &tick);
+	stamp->secPastEpoch = (epicsUInt32)(sec - POSIX_TIME_AT_EPICS_EPOCH - wr_local_offset);
+	stamp->nsec = (epicsUInt32)tick * wr_ns_per_tick;
+	if(stamp->nsec > 999999999)
+		stamp->nsec = 999999999;
+}
+
+/* Runs at a fixed rate on an absolute clock so a slow poll does not stretch
+   the period. A trip is a trip bit going from 0 to 1. */
+static void *StatusPollThread(void *arg)
+{
+	unsigned int state, last, changed, rising;
+	epicsTimeStamp stamp;
+	struct timespec next, mono, done;
+	statusEvent_t *ev;
+	int period, enabled, bit, slowWait=0;
+
+	last = ReadStatusWord(0, 1);
+	ReadWRTime(0, &stamp);
+	pthread_mutex_lock(&statusLock);
+	statusWord = last;
+	for(bit=0; bit<status_bit_num; bit++)
+		statusTime[bit] = stamp;
+	pthread_mutex_unlock(&statusLock);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(1)
+	{
+		pthread_mutex_lock(&tripLock);
+		period = watchPeriod;
+		enabled = autoCapture;
+		pthread_mutex_unlock(&tripLock);
+		next.tv_nsec += period * 1000;
+		while(next.tv_nsec >= 1000000000)
+		{
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &mono);
+		if(mono.tv_sec > next.tv_sec || (mono.tv_sec == next.tv_sec && mono.tv_nsec > next.tv_nsec))
+			next = mono;	// fell behind, do not try to catch up
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+			;
+		slowWait -= period;
+		clock_gettime(CLOCK_MONOTONIC, &mono);
+		state = ReadStatusWord(last, slowWait <= 0);
+		if(slowWait <= 0)
+			slowWait = status_slow_period;
+		clock_gettime(CLOCK_MONOTONIC, &done);
+		pollTimeLast = ((done.tv_sec - mono.tv_sec) * 1E+9 + (done.tv_nsec - mono.tv_nsec)) / 1E+3;
+		changed = state ^ last;
+		if(changed == 0)
+			continue;
+		rising = changed & state & trip_mask;
+		last = state;
+		ReadWRTime(0, &stamp);
+
+		pthread_mutex_lock(&statusLock);
+		for(bit=0; bit<status_bit_num; bit++)
+		{
+			if(!(changed & (1 << bit)))
+				continue;
+			statusTime[bit] = stamp;
+			ev = &statusRing[statusEvents % status_ring_len];
+			ev->stamp = stamp;
+			ev->bit = bit;
+			ev->value = (state >> bit) & 1;
+			statusEvents++;
+		}
+		statusWord = state;
+		pthread_mutex_unlock(&statusLock);
+		scanIoRequest(StatusinScanPvt);
+		DrvLog(DRVLOG_INFO, "Status 0x%03x, changed 0x%03x.\n", state, changed);
+
+		if(rising == 0 || !enabled)
+			continue;
+		pthread_mutex_lock(&tripLock);
+		tripCount++;
+		if(tripPending)
+			tripsMissed++;
+		else
+		{
+			tripPending = 1;
+			tripPendingCause = rising;
+			tripPendingStamp = stamp;
+			tripPendingMono = mono;
+			pthread_cond_signal(&tripCond);
+		}
+		pthread_mutex_unlock(&tripLock);
+		DrvLog(DRVLOG_WARN, "Trip 0x%02x detected, capturing history.\n", rising);
+	}
+	return NULL;
+}
+
+/* Newest edge first. ARRAY:123 is bit*2+value of each edge, ARRAY:124 its
+   time in us before the newest edge, whose time is the record time. */
+static void CopyStatusRing(int offset, float *data, unsigned int nelem, epicsTimeStamp *stamp)
+{
+	const statusEvent_t *ev, *newest;
+	unsigned int i, n;
+	pthread_mutex_lock(&statusLock);
+	n = (statusEvents < status_ring_len) ? statusEvents : status_ring_len;
+	newest = &statusRing[(statusEvents - 1) % status_ring_len];
+	if(n > 0)
+		*stamp = newest->stamp;
+	for(i=0; i<nelem; i++)
+	{
+		if(i >= n)
+		{
+			data[i] = -1;
+			continue;
+		}
+		ev = &statusRing[(statusEvents - 1 - i) % status_ring_len];
+		if(offset == 123)
+			data[i] = ev->bit * 2 + ev->value;
+		else
+			data[i] = epicsTimeDiffInSeconds(&newest->stamp, &ev->stamp) * 1E+6;
+	}
+	pthread_mutex_unlock(&statusLock);
+}
+
+static void *HistoryCaptureThread(void *arg)
+{
+	unsigned int cause;
+	epicsTimeStamp stamp;
+	struct timespec mono;
+	while(1)
+	{
+		pthread_mutex_lock(&tripLock);
+		while(!tripPending)
+			pthread_cond_wait(&tripCond, &tripLock);
+		cause = tripPendingCause;
+		stamp = tripPendingStamp;
+		mono = tripPendingMono;
+		pthread_mutex_unlock(&tripLock);
+		if(CaptureHistory(cause, &stamp, &mono) != 0)
+		{
+			pthread_mutex_lock(&tripLock);
+			tripsMissed++;
+			pthread_mutex_unlock(&tripLock);
+		}
+		pthread_mutex_lock(&tripLock);
+		tripPending = 0;
+		pthread_mutex_unlock(&tripLock);
+	}
+	return NULL;
+}
+
+static int IsHistoryWaveform(int offset)
+{
+	return (offset >= 31 && offset <= 48) || (offset >= 81 && offset <= 86);
+}
+
+/* Lowlevel history channel of a history waveform, -1 for the rest. */
+static int HistoryChannel(int offset)
+{
+	if(offset >= 31 && offset <= 38)
+		return (offset - 31) * 2;
+	if(offset >= 41 && offset <= 48)
+		return (offset - 41) * 2 + 1;
+	if(offset >= 81 && offset <= 86)
+		return offset - 81 + 16;
+	return -1;
+}
+
+/* Read every history channel into a new frame buffer for zero-copy delivery,
+   or with enable 0 drop the buffers so the records read the storage. */
+static void LoadHistoryBuffers(int enable)
+{
+	float *wf[history_channel_num], *old[history_channel_num];
+	int ch, i;
+	for(ch=0; ch<history_channel_num; ch++)
+	{
+		wf[ch] = enable ? FrameBufTake(histPool) : NULL;
+		if(wf[ch] == NULL)
+			continue;
+		GetHistoryDataFromSingleCh(ch, wf[ch]);
+		if(ch >= 16 && ch < 20)	// X/Y in um as copyHistoryXYArray() does
+		{
+			for(i=0; i<trip_buf_len; ++i)
+				wf[ch][i] = wf[ch][i] / 1000;
+		}
+	}
+	pthread_mutex_lock(&tripLock);
+	for(ch=0; ch<history_channel_num; ch++)
+	{
+		old[ch] = historyWf[ch];
+		historyWf[ch] = wf[ch];
+	}
+	pthread_mutex_unlock(&tripLock);
+	for(ch=0; ch<history_channel_num; ch++)
+		FrameBufRelease(old[ch]);
+}
+
 static void SetResetHistoryStorage(int value)
 {
-	GetSysTime();
-	printf("Reset history data buffer --> %d\n", value);
+	DrvLog(DRVLOG_INFO, "Reset history data buffer --> %d\n", value);
 	funcSetResetHistoryStorage(value);	
 //	printf("History Trigger have set to 1\n");
 }
 
 static void  SetTriggerExtractDataRatio(float value)
 {
-	GetSysTime();
-	printf("Set Data Ratio of Trigger data --> %f\n", value);
+	DrvLog(DRVLOG_INFO, "Set Data Ratio of Trigger data --> %f\n", value);
 	funcSetTriggerExtractDataRatio(value);
 }
 
 static void  SetHistoryExtractDataRatio(float value)
 {
-	GetSysTime();
-	printf("Set Data Ratio of History Data --> %f\n", value);
+	DrvLog(DRVLOG_INFO, "Set Data Ratio of History Data --> %f\n", value);
 	funcSetHistoryExtractDataRatio(value);
 }
 
@@ -1309,8 +2757,7 @@ static void  SetHistoryExtractDataRatio(float value)
 
 static void SetSyncIQStartSign(int value)
 {
-	GetSysTime();
-	printf("IOC Set Sync the Start Sign of IQ Signal --> %d\n", value);
+	DrvLog(DRVLOG_INFO, "IOC Set Sync the Start Sign of IQ Signal --> %d\n", value);
 	funcSetSyncIQStartSign(value);
 }
 
@@ -1359,7 +2806,7 @@ static void SetBPMkxy(int channel, float value)
 		val = (int)(value*1E+6);
 	}
 	funcSetBPMkxy(channel, val);
-	printf("The Kxy or Ksum has been set to %d.\n", val);
+	DrvLog(DRVLOG_INFO, "The Kxy or Ksum has been set to %d.\n", val);
 }
 
 static void SetBPMxyOffset(int channel, int value)
@@ -1367,7 +2814,7 @@ static void SetBPMxyOffset(int channel, int value)
 	int val;
 	val = (value*1E+6);
 	funcSetBPMxyOffset(channel, val);
-	printf("The xy offset of (%d) has been set to %d.\n", channel, val);
+	DrvLog(DRVLOG_INFO, "The xy offset of (%d) has been set to %d.\n", channel, val);
 }
 
 static void SetBPMxyLimits(int channel, int value)
@@ -1375,7 +2822,7 @@ static void SetBPMxyLimits(int channel, int value)
 	int val;
 	val = (value*1000);
 	funcSetBPMxyLimits(channel, val);
-	printf("The xy limit of (%d) has been set to %d.\n", channel, val);
+	DrvLog(DRVLOG_INFO, "The xy limit of (%d) has been set to %d.\n", channel, val);
 }
 
 static void SetBPMSumLimits(int channel, int value)
@@ -1383,90 +2830,46 @@ static void SetBPMSumLimits(int channel, int value)
 	int val;
 	val = (value*1);
 	funcSetBPMSumLimits(channel, val);
-	printf("The Sum limit of (%d) has been set to %d.\n", channel, val);
+	DrvLog(DRVLOG_INFO, "The Sum limit of (%d) has been set to %d.\n", channel, val);
 }
 
 static void SetFastIntlkFilterTime(float value)
 {
 	funcSetBPMProtectFilterTime(value);
-	printf("The Fast Interlock Filter has been set to %f us.\n", value);
+	DrvLog(DRVLOG_INFO, "The Fast Interlock Filter has been set to %f us.\n", value);
 }
 
 static void SetDDSMode(int value)
 {
-	GetSysTime();
-	printf("IOC Set DDS mode to --> %d\n", value);
+	DrvLog(DRVLOG_INFO, "IOC Set DDS mode to --> %d\n", value);
 	funcSetFreqControlWordtoDDS(value);
 }
 
 static void SelectTriggerSource(int value)
 {
-	GetSysTime();
-	printf("IOC Set Select Trigger Source of %d.\n", value);
+	DrvLog(DRVLOG_INFO, "IOC Set Select Trigger Source of %d.\n", value);
 	funcSetSelectExternelTrigger(value);
 }
 
+// The file is parsed on the calibration store thread, see calibrationStore.c.
 static void  ReadCSVparametersfile(int value)
 {
-	FILE *fp = NULL;
-	int i=0;
-	char *line,*record;
-	char buffer[1024];
 	if(value==1)
 	{
-		GetSysTime();
-		printf("Read CSV parameters file-->%d\n",value);
-		fp = fopen(CSVfile_Path,"r");
-		if(fp!=NULL)
-		{
-			GetSysTime();
-			printf("Open CSV parameters file successed!\n");
-			fseek(fp,0,SEEK_SET);
-			while((line=fgets(buffer,sizeof(buffer),fp))!=NULL)
-			{
-				int j=0;
-				record=strtok(line,",");
-				while(record!=NULL)
-				{
-					if(j!=1 && j!=5){
-						parameters[i][j]=atof(record);
-						record=strtok(NULL,",");
-					}else{
-						
-						record=strtok(NULL,",");
-					}
-					j++;
-				}
-				i++;
-			}
-			fclose(fp);
-			fp=NULL;
-			int j;
-			for(i=0;i<9;i++)
-			{
-				for(j=0;j<7;j++){
-					printf("%e\t",parameters[i][j]);
-				}
-				printf("\n");
-			}
-		}
-		else{
-			GetSysTime();
-			printf("Failed to read csv file!\n");
-		}
+		DrvLog(DRVLOG_INFO, "Reload CSV parameters file-->%d\n",value);
+		CalStoreRequestReload();
 	}
 }
 
 void  Getparameters(int row,int column,double* data)
 {
-	*data=parameters[row][column];
+	CalStoreGet(row, column, data);
 }
 
 static void SetOffset(int row, double value)
 {
-	parameters[row][1]=value;
-	GetSysTime();
-	printf("The offset %d has been set to %f\n", row, value);
+	CalStoreSetOffset(row, value);
+	DrvLog(DRVLOG_INFO, "The offset %d has been set to %f\n", row, value);
 }
 
 static void SetSysTime(void)
@@ -1480,50 +2883,14 @@ static void SetSysTime(void)
 	clock_settime(CLOCK_REALTIME, &ts);	
 }
 
-static void GetSysTime(void)
-{
-	struct timeval tv;
-	gettimeofday(&tv,NULL);//获取1970-1-1到现在的时间结果保存到tv中
-	uint64_t sec=tv.tv_sec;
-//	uint64_t min=tv.tv_sec/60;
-	struct tm cur_tm;//保存转换后的时间结果
-	localtime_r((time_t*)&sec,&cur_tm);
-	char cur_time[20];
-	snprintf(cur_time,20,"%d-%02d-%02d %02d:%02d:%02d",cur_tm.tm_year+1900,cur_tm.tm_mon+1,cur_tm.tm_mday,cur_tm.tm_hour,cur_tm.tm_min,cur_tm.tm_sec);
-	printf("%s ",cur_time);		
-}
-
 
-static void calculateAvgVoltage(float *wfBuf, int ch_N, int length)
+/* Average of the baseline-corrected waveform over the average window, the
+   signal mean minus the baseline as before. */
+static void calculateAvgVoltage(const float *baseBuf, int ch_N, int length)
 {
-	int i=0;
-	float signal_sum = 0;  // sum of effective signal
-	float background_sum = 0; // sum of background signal
-	int signal_count = 0; // count of effective signal
-	int background_count = 0; // count of background signal
 	float avg_volt = 0; // average voltage
 
-	for (i=0;i<length;i++){
-		if(i>=AVGStart && i<=AVGStop){
-			signal_sum += wfBuf[i];
-
-		}
-		if(i>=BackGroundStart && i<=BackGroundStop)
-		{
-			background_sum += wfBuf[i];
-
-		}	
-	}
-	signal_count = AVGStop - AVGStart + 1;
-	background_count = BackGroundStop - BackGroundStart + 1;
-
-	if (signal_count > 0 && background_count > 0){
-		avg_volt = signal_sum / signal_count - background_sum / background_count;
-
-	}
-	else{
-		avg_volt = 0;
-	}
+	avg_volt = WindowAverage(baseBuf, length);
 
 	switch(ch_N){
 		case 0: rf3_avg_volt = avg_volt; break;
@@ -1537,4 +2904,1883 @@ static void calculateAvgVoltage(float *wfBuf, int ch_N, int length)
 	
 	}
 	
-}
\ No newline at end of file
+}
+
+static void SetProcConfig(int offset, int value)
+{
+	int valid;
+	unsigned int epoch;
+	pthread_mutex_lock(&cfgLock);
+	switch(offset)
+	{
+		case 19: pendingCfg.pulseMode = value; break;
+		case 20: pendingCfg.AVGStart = value; break;
+		case 21: pendingCfg.AVGStop = value; break;
+		case 27: pendingCfg.BackGroundStart = value; break;
+		case 28: pendingCfg.BackGroundStop = value; break;
+		default: break;
+	}
+	pendingCfg.epoch++;
+	pendingCfgValid = ValidateProcConfig(&pendingCfg, buf_len);
+	valid = pendingCfgValid;
+	epoch = pendingCfg.epoch;
+	pthread_mutex_unlock(&cfgLock);
+	if(!valid)
+	{
+		DrvLog(DRVLOG_WARN, "Processing config %u is not valid (window start > stop or stop >= %d), keep the last valid one.\n", epoch, buf_len);
+	}
+}
+
+// Both windows must satisfy 0 <= start <= stop < length.
+static int ValidateProcConfig(const procConfig_t *cfg, int length)
+{
+	if(cfg->AVGStart < 0 || cfg->AVGStart > cfg->AVGStop || cfg->AVGStop >= length)
+		return 0;
+	if(cfg->BackGroundStart < 0 || cfg->BackGroundStart > cfg->BackGroundStop || cfg->BackGroundStop >= length)
+		return 0;
+	return 1;
+}
+
+// Called once per trigger frame, before the records of the frame are scanned.
+static void LatchProcConfig(void)
+{
+	pthread_mutex_lock(&cfgLock);
+	if(pendingCfgValid && pendingCfg.epoch != frameCfg.epoch)
+		frameCfg = pendingCfg;
+	pthread_mutex_unlock(&cfgLock);
+}
+
+static void GetFrameConfig(procConfig_t *cfg)
+{
+	pthread_mutex_lock(&cfgLock);
+	*cfg = frameCfg;
+	pthread_mutex_unlock(&cfgLock);
+}
+
+static void ReadFrameTime(epicsTimeStamp *stamp)
+{
+	ReadWRTime(1, stamp);
+}
+
+static void BeginFrameUpdate(void)
+{
+	__atomic_add_fetch(&frameUpdateSeq, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void EndFrameUpdate(void)
+{
+	__atomic_add_fetch(&frameUpdateSeq, 1, __ATOMIC_RELEASE);
+}
+
+static void LatchFrameTime(const epicsTimeStamp *stamp)
+{
+	pthread_mutex_lock(&cfgLock);
+	frameTime = *stamp;
+	frameSeq++;
+	pthread_mutex_unlock(&cfgLock);
+}
+
+static float WindowAverage(const float *data, int length)
+{
+	int i, n;
+	float sum=0;
+	procConfig_t cfg;
+	GetFrameConfig(&cfg);
+	n = WindowPoints(&cfg.AVGStart, &cfg.AVGStop, length);
+	if(n <= 0)
+		return 0;
+	for(i=cfg.AVGStart; i<=cfg.AVGStop; ++i)
+		sum += data[i];
+	return sum/n;
+}
+
+/* Returns 1 if the frame is to be converted and posted. */
+static int GateFrame(const epicsTimeStamp *stamp)
+{
+	struct timespec now;
+	double elapsed;
+	float threshold = beamThreshold;
+	float alive = keepAlive;
+	int ch, publish = 1;
+
+	if(stamp->secPastEpoch == lastFrameTime.secPastEpoch && stamp->nsec == lastFrameTime.nsec)
+	{
+		framesDuplicate++;
+		publish = 0;
+	}
+	else
+	{
+		lastFrameTime = *stamp;
+		beamPresent = 1;
+		if(threshold > 0)
+		{
+			beamPresent = 0;
+			for(ch=20; ch<22 && !beamPresent; ch++)
+			{
+				ReadTriggerData(1, ch, frameDmaBuf);
+				if(WindowAverage(frameDmaBuf, buf_len) >= threshold)
+					beamPresent = 1;
+			}
+			if(!beamPresent)
+			{
+				framesNoBeam++;
+				publish = 0;
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(!publish && alive > 0)
+	{
+		elapsed = (now.tv_sec - lastPublish.tv_sec) + (now.tv_nsec - lastPublish.tv_nsec) / 1E+9;
+		if(elapsed >= alive)
+			publish = 1;
+	}
+	if(publish)
+	{
+		lastPublish = now;
+		framesPublished++;
+	}
+	return publish;
+}
+
+static void SetFrameGate(int offset, float value)
+{
+	if(value < 0)
+		value = 0;
+	if(offset == 34)
+	{
+		beamThreshold = value;
+		DrvLog(DRVLOG_INFO, "Beam present when the window sum reaches %f (0 = always).\n", value);
+	}
+	else
+	{
+		keepAlive = value;
+		DrvLog(DRVLOG_INFO, "Publish gated frames every %f s (0 = never).\n", value);
+	}
+}
+
+/* Timestamp of the frame the records are currently published from, for
+   device support with TSE=-2. Returns the frame sequence number. */
+unsigned int GetFrameTime(epicsTimeStamp *stamp)
+{
+	unsigned int seq;
+	pthread_mutex_lock(&cfgLock);
+	if(stamp != NULL)
+		*stamp = frameTime;
+	seq = frameSeq;
+	pthread_mutex_unlock(&cfgLock);
+	return seq;
+}
+
+/* Two passes so the second loop has no early exit and vectorizes. */
+static void CheckLimits(const float *data, int length, float low, float high, preview_t *res)
+{
+	int i, count=0;
+	float e, peak=-INFINITY;
+	res->firstIndex = -1;
+	for(i=0; i<length; ++i)
+	{
+		if(data[i] > high || data[i] < low)
+		{
+			res->firstIndex = i;
+			break;
+		}
+	}
+	for(i=0; i<length; ++i)
+	{
+		e = fmaxf(data[i] - high, low - data[i]);
+		count += (e > 0);
+		peak = fmaxf(peak, e);
+	}
+	res->count = count;
+	res->peak = peak;
+}
+
+/* Limit pair of a preview signal as the hardware has it: two xy limit
+   channels per axis, one sum limit per BPM (the sum trips above it). */
+static int GetPreviewLimits(int index, float *low, float *high)
+{
+	shadowReg_t a, b;
+	pthread_mutex_lock(&hwLock);
+	if(index < 4)
+	{
+		a = shadowRegs[16][index*2];
+		b = shadowRegs[16][index*2+1];
+	}
+	else
+	{
+		a = shadowRegs[18][index-4];
+		b = a;
+	}
+	pthread_mutex_unlock(&hwLock);
+	if(!a.valid || !b.valid)
+		return -1;
+	if(index < 4)
+	{
+		*low = fminf((int)a.value, (int)b.value);
+		*high = fmaxf((int)a.value, (int)b.value);
+	}
+	else
+	{
+		*low = -INFINITY;
+		*high = (int)a.value;
+	}
+	return 0;
+}
+
+static void InterlockPreview(void)
+{
+	int i;
+	float low, high;
+	preview_t res[preview_num];
+	for(i=0; i<preview_num; i++)
+	{
+		res[i].firstIndex = -1;
+		res[i].count = 0;
+		res[i].peak = 0;
+		if(GetPreviewLimits(i, &low, &high) != 0)
+			continue;
+		/* X/Y in um like the limits, and the raw sums. */
+		if(i < 4)
+			CheckLimits(FrameXY(i), buf_len, low, high, &res[i]);
+		else
+		{
+			pthread_mutex_lock(&chanLock[16+i]);
+			CheckLimits(chanWf[16+i], buf_len, low, high, &res[i]);
+			pthread_mutex_unlock(&chanLock[16+i]);
+		}
+	}
+	pthread_mutex_lock(&previewLock);
+	memcpy(previewResult, res, sizeof(res));
+	pthread_mutex_unlock(&previewLock);
+}
+
+/* Fetch and convert channel k of frameChannels[] and compute its per-pulse
+   scalars, which are updated on every frame whatever the waveform rate. */
+/* Returns -1 if the channel keeps its previous frame: out of memory, the
+   published buffer may still be read by records and can't be reused. */
+static int ProcessChannel(unsigned int k)
+{
+	int ch;
+	float *wf, *old;
+	wf = FrameBufTake(trigPool);
+	if(wf == NULL)
+	{
+		__atomic_add_fetch(&framesDropped, 1, __ATOMIC_RELAXED);
+		if(k >= 16 && k < 20)
+			xyNext[k-16] = NULL;
+		return -1;
+	}
+	if(k >= 16 && k < 20)
+	{
+		copyXYArray(wf, wf, k, buf_len);
+		LatchXYAvg(wf, k, buf_len);
+		xyNext[k-16] = wf;
+		return 0;
+	}
+	pthread_mutex_lock(&chanLock[k]);
+	old = chanWf[k];
+	chanWf[k] = wf;
+	if(k < 8)
+	{
+		ch = k*2;
+		copyArray(wf, wf, ch, buf_len);
+		UpdateBaseline(k, wf, buf_len);
+		calculateAvgVoltage(chanBase[k], ch, buf_len);
+	}
+	else if(k < 16)
+	{
+		ch = (k-8)*2 + 1;
+		copyPhArray(wf, wf, ch, buf_len);
+		LatchFlattopPhase(wf, ch);
+	}
+	else
+	{
+		ReadTriggerData(1, k, wf);
+	}
+	pthread_mutex_unlock(&chanLock[k]);
+	FrameBufRelease(old);
+	return 0;
+}
+
+/* Take channels until none is left. Called with poolLock held. */
+static void RunChannels(void)
+{
+	unsigned int k;
+	int post;
+	while(poolNext < frame_channel_num)
+	{
+		k = poolNext++;
+		post = poolPost;
+		pthread_mutex_unlock(&poolLock);
+		if(ProcessChannel(k) == 0 && post && (k < 16 || k >= 20))	// X/Y are posted once corrected
+			PostChannel(k);
+		pthread_mutex_lock(&poolLock);
+		if(--poolPending == 0)
+			pthread_cond_broadcast(&poolDone);
+	}
+}
+
+static void *PoolWorker(void *arg)
+{
+	unsigned int seen;
+	pthread_mutex_lock(&poolLock);
+	seen = poolGeneration;
+	while(1)
+	{
+		while(poolGeneration == seen)
+			pthread_cond_wait(&poolStart, &poolLock);
+		seen = poolGeneration;
+		RunChannels();
+	}
+	return NULL;
+}
+
+/* pthread() takes channels too, so without workers it does them all. The
+   interlock preview sees X/Y as the hardware does, before the position maps. */
+static void ProcessFrame(int post)
+{
+	struct timespec t0, t1;
+	float elapsed;
+	int k;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_mutex_lock(&poolLock);
+	poolNext = 0;
+	poolPending = frame_channel_num;
+	poolPost = post;
+	poolGeneration++;
+	pthread_cond_broadcast(&poolStart);
+	RunChannels();
+	while(poolPending > 0)
+		pthread_cond_wait(&poolDone, &poolLock);
+	pthread_mutex_unlock(&poolLock);
+	ComputeSoftXY();
+	IntegrateCharge();
+	CorrelateBPMs();
+	InterlockPreview();
+	CorrectPositions();
+	for(k=16; k<20 && post; k++)
+		PostChannel(k);
+	AverageFrame();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	elapsed = ((t1.tv_sec - t0.tv_sec) * 1E+9 + (t1.tv_nsec - t0.tv_nsec)) / 1E+3;
+	procTimeLast = elapsed;
+	if(elapsed > procTimeMax)
+		procTimeMax = elapsed;
+}
+
+/* Called by pthread() once every channel of the frame is ready, nothing else
+   writes chanWf[] then. The FPGA gets the xy offset truncated to whole mm
+   (SetBPMxyOffset), so it is truncated here too. */
+static void ComputeSoftXY(void)
+{
+	shadowReg_t k[4], off[4];
+	procConfig_t cfg;
+	const float *a, *c, *hw;
+	float *out;
+	float gain, base, d, sum;
+	int i, n, start, stop, points;
+
+	pthread_mutex_lock(&hwLock);
+	for(i=0; i<4; i++)
+	{
+		k[i] = shadowRegs[14][i];
+		off[i] = shadowRegs[15][i];
+	}
+	pthread_mutex_unlock(&hwLock);
+	GetFrameConfig(&cfg);
+
+	pthread_mutex_lock(&softLock);
+	for(i=0; i<4; i++)
+	{
+		/* mm to um like the FPGA X/Y waveforms */
+		gain = k[i].valid ? k[i].value * 1000 : 0;
+		base = off[i].valid ? (int)off[i].value * 1000 : 0;
+		a = chanWf[softPickups[i][0]];
+		c = chanWf[softPickups[i][1]];
+		hw = FrameXY(i);
+		out = softXY[i];
+		/* No branch in the loop so it vectorizes; a zero sum gives the offset
+		   (the amplitudes are not negative, so A-C is zero too). */
+		for(n=0; n<buf_len; n++)
+		{
+			d = a[n] + c[n];
+			out[n] = base + gain * (a[n] - c[n]) / (d + (d == 0));
+		}
+		start = cfg.AVGStart;
+		stop = cfg.AVGStop;
+		points = WindowPoints(&start, &stop, buf_len);
+		sum = 0;
+		for(n=start; n<=stop && points>0; n++)
+		{
+			d = out[n] - hw[n];
+			sum += d * d;
+		}
+		softRms[i] = (points > 0) ? sqrtf(sum / points) : 0;
+	}
+	pthread_mutex_unlock(&softLock);
+}
+
+/* X/Y waveform i of the frame being processed, before the position maps; the
+   one of the previous frame if no frame buffer was free. pthread() only. */
+static const float *FrameXY(int i)
+{
+	return (xyNext[i] != NULL) ? xyNext[i] : chanWf[16+i];
+}
+
+/* Correct X/Y of each BPM with its position map, if one is switched on, and
+   take the window averages again from the corrected waveforms. Only then are
+   the buffers swapped into chanWf[], so no reader sees them change. */
+static void CorrectPositions(void)
+{
+	struct timespec t0, t1;
+	float avgX=0, avgY=0;
+	float *old;
+	int bpm, applied, i;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(bpm=0; bpm<pos_map_bpm_num; bpm++)
+	{
+		if(xyNext[bpm*2] == NULL || xyNext[bpm*2+1] == NULL)
+			continue;
+		applied = PosMapApply(bpm, xyNext[bpm*2], xyNext[bpm*2+1], buf_len);
+		if(applied)
+		{
+			avgX = WindowAverage(xyNext[bpm*2], buf_len);
+			avgY = WindowAverage(xyNext[bpm*2+1], buf_len);
+		}
+		if(applied && bpm == 0)
+		{
+			X1_avg = avgX;
+			Y1_avg = avgY;
+		}
+		else if(applied)
+		{
+			X2_avg = avgX;
+			Y2_avg = avgY;
+		}
+	}
+	for(i=0; i<4; i++)
+	{
+		if(xyNext[i] == NULL)
+			continue;
+		pthread_mutex_lock(&chanLock[16+i]);
+		old = chanWf[16+i];
+		chanWf[16+i] = xyNext[i];
+		pthread_mutex_unlock(&chanLock[16+i]);
+		FrameBufRelease(old);
+		xyNext[i] = NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	mapTimeLast = ((t1.tv_sec - t0.tv_sec) * 1E+9 + (t1.tv_nsec - t0.tv_nsec)) / 1E+3;
+}
+
+/* Baseline of amplitude channel k for this frame, and chanBase[k] with it
+   subtracted. Called with chanLock[k] held. */
+static float UpdateBaseline(unsigned int k, const float *wfBuf, int length)
+{
+	procConfig_t cfg;
+	float bg, base, alpha;
+	float *out = chanBase[k];
+	int i, n, frames;
+	unsigned int epoch;
+
+	GetFrameConfig(&cfg);
+	n = WindowPoints(&cfg.BackGroundStart, &cfg.BackGroundStop, length);
+	bg = 0;
+	for(i=cfg.BackGroundStart; i<=cfg.BackGroundStop && n>0; i++)
+		bg += wfBuf[i];
+	bg = (n > 0) ? bg / n : 0;
+
+	pthread_mutex_lock(&chargeLock);
+	frames = baselineFrames;
+	epoch = baselineEpoch;
+	pthread_mutex_unlock(&chargeLock);
+	if(frames > 0)
+	{
+		/* Restart from this pulse whenever the length is set again. */
+		alpha = 1.0f / frames;
+		if(baseRunEpoch[k] != epoch)
+		{
+			baseRun[k] = bg;
+			baseRunEpoch[k] = epoch;
+		}
+		else
+			baseRun[k] += alpha * (bg - baseRun[k]);
+		base = baseRun[k];
+	}
+	else
+		base = bg;
+
+	for(i=0; i<length; i++)
+		out[i] = wfBuf[i] - base;
+	baseline[k] = base;
+	return base;
+}
+
+/* Called by pthread() once every channel of the frame is ready. */
+static void IntegrateCharge(void)
+{
+	int start[charge_gate_num], stop[charge_gate_num];
+	float scale[2], q[2][charge_gate_num];
+	float sum;
+	int bpm, g, p, i;
+
+	pthread_mutex_lock(&chargeLock);
+	memcpy(start, gateStart, sizeof(start));
+	memcpy(stop, gateStop, sizeof(stop));
+	memcpy(scale, chargeScale, sizeof(scale));
+	pthread_mutex_unlock(&chargeLock);
+
+	for(bpm=0; bpm<2; bpm++)
+	{
+		for(g=0; g<charge_gate_num; g++)
+		{
+			q[bpm][g] = 0;
+			if(start[g] < 0 || stop[g] < start[g] || start[g] >= buf_len)
+				continue;
+			if(stop[g] >= buf_len)
+				stop[g] = buf_len - 1;
+			sum = 0;
+			for(p=bpm*4; p<bpm*4+4; p++)
+			{
+				for(i=start[g]; i<=stop[g]; i++)
+					sum += chanBase[p][i];
+			}
+			q[bpm][g] = sum * scale[bpm];
+		}
+	}
+
+	pthread_mutex_lock(&chargeLock);
+	memcpy(charge, q, sizeof(charge));
+	pthread_mutex_unlock(&chargeLock);
+}
+
+/* REG:38/39 gate start/stop sample (ch gate, -1 disables the gate), REG:40
+   charge scale (ch bpm), REG:41 running baseline length in pulses (0 uses
+   the background window of each pulse). */
+static void SetIntegration(int offset, int channel, float value)
+{
+	pthread_mutex_lock(&chargeLock);
+	switch(offset)
+	{
+		case 38:
+			if(channel >= 0 && channel < charge_gate_num)
+				gateStart[channel] = (int)value;
+			break;
+		case 39:
+			if(channel >= 0 && channel < charge_gate_num)
+				gateStop[channel] = (int)value;
+			break;
+		case 40:
+			if(channel >= 0 && channel < 2)
+				chargeScale[channel] = value;
+			break;
+		case 41:
+			baselineFrames = (value < 0) ? 0 : (int)value;
+			baselineEpoch++;
+			break;
+		default:
+			break;
+	}
+	pthread_mutex_unlock(&chargeLock);
+}
+
+/* Called by pthread() with the final waveforms of the frame in chanWf[]. The
+   loops are plain array arithmetic so the compiler can vectorize them. */
+static void AverageFrame(void)
+{
+	struct timespec t0, t1;
+	const float *x;
+	float *slot;
+	double *acc;
+	double alpha;
+	unsigned int k;
+	int i, ring;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_mutex_lock(&avgLock);
+	if(avgMode == 0)
+	{
+		pthread_mutex_unlock(&avgLock);
+		return;
+	}
+	ring = (avgCount < avgPulses) ? (avgHead + avgCount) % avgPulses : avgHead;
+	alpha = 1.0 / avgPulses;
+	for(k=0; k<frame_channel_num; k++)
+	{
+		x = chanWf[k];
+		acc = avgAcc[k];
+		if(avgMode == 1)
+		{
+			slot = &avgRing[((size_t)ring * frame_channel_num + k) * buf_len];
+			if(avgCount < avgPulses)
+			{
+				for(i=0; i<buf_len; i++)
+					acc[i] += x[i];
+			}
+			else
+			{
+				for(i=0; i<buf_len; i++)
+					acc[i] += x[i] - slot[i];
+			}
+			memcpy(slot, x, buf_len * sizeof(float));
+		}
+		else if(avgCount == 0)
+		{
+			for(i=0; i<buf_len; i++)
+				acc[i] = x[i];
+		}
+		else
+		{
+			for(i=0; i<buf_len; i++)
+				acc[i] += alpha * (x[i] - acc[i]);
+		}
+	}
+	if(avgCount < avgPulses)
+		avgCount++;
+	else
+		avgHead = (avgHead + 1) % avgPulses;
+	pthread_mutex_unlock(&avgLock);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	avgTimeLast = ((t1.tv_sec - t0.tv_sec) * 1E+9 + (t1.tv_nsec - t0.tv_nsec)) / 1E+3;
+}
+
+/* REG:42 mode (0 off, 1 boxcar, 2 exponential), REG:43 pulses (the boxcar
+   length, or the time constant of the exponential average), REG:44 restart.
+   Any of them restarts the average. The whole update is done under avgLock,
+   so two puts at once can't mix their mode and pulses. */
+static void SetAverage(int offset, float value)
+{
+	int mode, pulses;
+	float *ring = NULL;
+
+	if(offset == 44 && (int)value == 0)
+		return;
+	pthread_mutex_lock(&avgLock);
+	mode = avgMode;
+	pulses = avgPulses;
+	if(offset == 42)
+		mode = ((int)value >= 0 && (int)value <= 2) ? (int)value : 0;
+	else if(offset == 43)
+		pulses = ((int)value < 1) ? 1 : (int)value;
+	if(mode == 1 && pulses > avg_max_boxcar)
+	{
+		DrvLog(DRVLOG_WARN, "Boxcar average of %d pulses, limited to %d.\n", pulses, avg_max_boxcar);
+		pulses = avg_max_boxcar;
+	}
+	if(mode == 1)
+	{
+		ring = malloc((size_t)pulses * frame_channel_num * buf_len * sizeof(float));
+		if(ring == NULL)
+		{
+			DrvLog(DRVLOG_ERROR, "No memory for a boxcar average of %d pulses, averaging is off.\n", pulses);
+			mode = 0;
+		}
+	}
+	free(avgRing);
+	avgRing = ring;
+	avgMode = mode;
+	avgPulses = pulses;
+	avgCount = 0;
+	avgHead = 0;
+	memset(avgAcc, 0, sizeof(avgAcc));
+	pthread_mutex_unlock(&avgLock);
+}
+
+static void CopyAverage(unsigned int k, float *data, unsigned int nelem)
+{
+	double scale;
+	unsigned int i;
+	if(k >= frame_channel_num)
+		return;
+	if(nelem > buf_len)
+		nelem = buf_len;
+	pthread_mutex_lock(&avgLock);
+	scale = (avgMode == 1 && avgCount > 0) ? 1.0 / avgCount : 1.0;
+	for(i=0; i<nelem; i++)
+		data[i] = avgAcc[k][i] * scale;
+	pthread_mutex_unlock(&avgLock);
+}
+
+/* Called by pthread() once every channel of the frame is ready. */
+static void CorrelateBPMs(void)
+{
+	static float wf[buf_len];	// pthread() only
+	const float *p1a = chanWf[9], *p1b = chanWf[10], *p1c = chanWf[11];
+	const float *p2a = chanWf[13], *p2b = chanWf[14], *p2c = chanWf[15];
+	procConfig_t cfg;
+	double distance, freq, ref, energy, mass, gamma, beta, t0, dt;
+	float da, db, dc, d0, d, sum;
+	int i, n;
+
+	/* Each pair is wrapped before the mean, so pickups on both sides of
+	   +-180 do not pull the mean away. */
+	for(i=0; i<buf_len; i++)
+	{
+		da = p2a[i] - p1a[i];
+		db = p2b[i] - p1b[i];
+		dc = p2c[i] - p1c[i];
+		da -= 360 * rintf(da / 360);
+		db -= 360 * rintf(db / 360);
+		dc -= 360 * rintf(dc / 360);
+		db -= 360 * rintf((db - da) / 360);
+		dc -= 360 * rintf((dc - da) / 360);
+		d = (da + db + dc) / 3;
+		wf[i] = d - 360 * rintf(d / 360);
+	}
+
+	/* Window mean taken around the first sample of the window for the same
+	   reason. */
+	GetFrameConfig(&cfg);
+	n = WindowPoints(&cfg.AVGStart, &cfg.AVGStop, buf_len);
+	d0 = (n > 0) ? wf[cfg.AVGStart] : 0;
+	sum = 0;
+	for(i=cfg.AVGStart; i<=cfg.AVGStop && n>0; i++)
+	{
+		d = wf[i] - d0;
+		sum += d - 360 * rintf(d / 360);
+	}
+	d = (n > 0) ? d0 + sum / n : 0;
+	d -= 360 * rintf(d / 360);
+
+	pthread_mutex_lock(&corrLock);
+	distance = flightDistance;
+	freq = rfFrequency;
+	ref = phaseDiffRef;
+	energy = beamEnergy;
+	mass = restMass;
+	memcpy(phaseDiffWf, wf, sizeof(phaseDiffWf));
+	phaseDiff = d;
+	tofDelta = 0;
+	tofTotal = 0;
+	energyDev = 0;
+	if(freq > 0)
+	{
+		ref = d - ref;
+		ref -= 360 * rint(ref / 360);
+		dt = ref / 360.0 / (freq * 1E+6);
+		tofDelta = dt * 1E+12;
+		if(distance > 0 && energy > 0 && mass > 0)
+		{
+			gamma = 1 + energy / mass;
+			beta = sqrt(1 - 1 / (gamma * gamma));
+			t0 = distance / (beta * 299792458.0);
+			tofTotal = (t0 + dt) * 1E+9;
+			energyDev = -gamma * (gamma + 1) * dt / t0;
+		}
+	}
+	pthread_mutex_unlock(&corrLock);
+}
+
+/* REG:45 distance (m), REG:46 RF frequency (MHz), REG:47 reference phase
+   difference (deg), REG:48 nominal kinetic energy (MeV), REG:49 rest mass
+   (MeV). */
+static void SetCorrelation(int offset, float value)
+{
+	pthread_mutex_lock(&corrLock);
+	switch(offset)
+	{
+		case 45: flightDistance = value; break;
+		case 46: rfFrequency = value; break;
+		case 47: phaseDiffRef = value; break;
+		case 48: beamEnergy = value; break;
+		case 49: restMass = value; break;
+		default: break;
+	}
+	pthread_mutex_unlock(&corrLock);
+}
+
+/* Index of the offset in frameChannels[], frame_channel_num if it is not one. */
+static unsigned int FrameChannelIndex(int offset)
+{
+	unsigned int k;
+	for(k=0; k<frame_channel_num; k++)
+	{
+		if(frameChannels[k] == offset)
+			break;
+	}
+	return k;
+}
+
+/* Copy a processed channel of the last published frame. Returns -1 if the
+   offset is not one of frameChannels[]. */
+static int CopyChannel(int offset, float *data, unsigned int nelem)
+{
+	unsigned int k = FrameChannelIndex(offset);
+	if(k == frame_channel_num)
+		return -1;
+	if(nelem > buf_len)
+		nelem = buf_len;
+	pthread_mutex_lock(&chanLock[k]);
+	memcpy(data, chanWf[k], nelem * sizeof(float));
+	pthread_mutex_unlock(&chanLock[k]);
+	return 0;
+}
+
+static int WaveformDue(void)
+{
+	static unsigned int frames=0;
+	struct timespec now;
+	double elapsed;
+	int divisor = __atomic_load_n(&wfDivisor, __ATOMIC_RELAXED);
+	float maxRate = wfMaxRate;
+	if((frames++ % divisor) != 0)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - wfLastPost.tv_sec) + (now.tv_nsec - wfLastPost.tv_nsec) / 1E+9;
+	if(maxRate > 0 && elapsed < 1 / maxRate)
+		return 0;
+	wfLastPost = now;
+	wfPosted++;
+	return 1;
+}
+
+static void SetWaveformRate(int offset, float value)
+{
+	if(offset == 32)
+	{
+		if(value < 1)
+			value = 1;
+		__atomic_store_n(&wfDivisor, (int)value, __ATOMIC_RELAXED);
+		DrvLog(DRVLOG_INFO, "Post trigger waveforms on every %d frame(s).\n", (int)value);
+	}
+	else
+	{
+		if(value < 0)
+			value = 0;
+		wfMaxRate = value;
+		DrvLog(DRVLOG_INFO, "Post trigger waveforms at most %f Hz (0 = no limit).\n", value);
+	}
+}
+
+/* Until device support has reported the monitors everything is wanted. */
+static int OffsetWanted(int offset)
+{
+	if(!__atomic_load_n(&demandDriven, __ATOMIC_RELAXED) || demandHook == NULL)
+		return 1;
+	return __atomic_load_n(&wfDemand[offset], __ATOMIC_RELAXED) > 0;
+}
+
+static void PostChannel(unsigned int k)
+{
+	if(OffsetWanted(frameChannels[k]))
+	{
+		scanIoRequest(chanScanPvt[k]);
+		__atomic_add_fetch(&scansPosted, 1, __ATOMIC_RELAXED);
+	}
+	else
+		__atomic_add_fetch(&scansSkipped, 1, __ATOMIC_RELAXED);
+}
+
+/* Post the trigger waveforms besides the processed channels. */
+static void PostTrigWaveforms(void)
+{
+	int offset;
+	scanIoRequest(TriginScanPvt);
+	for(offset=0; offset<demand_offset_num; offset++)
+	{
+		if(demandHook != NULL && !wfHasRecords[offset])
+			continue;
+		if(FrameChannelIndex(offset) < frame_channel_num || offset == 123 || offset == 124)
+			continue;	// on chanScanPvt[] and StatusinScanPvt
+		if(OffsetWanted(offset))
+		{
+			scanIoRequest(wfScanPvt[offset]);
+			__atomic_add_fetch(&scansPosted, 1, __ATOMIC_RELAXED);
+		}
+		else
+			__atomic_add_fetch(&scansSkipped, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static float *AdcSlot(int slot, int ch)
+{
+	return &adcRing[((size_t)slot * adc_channel_num + ch) * adc_buf_len];
+}
+
+/* Called by pthread() on every frame. Returns the slot the raw channels of
+   this frame went to, -1 if they were not read. */
+static int CaptureADC(const epicsTimeStamp *stamp, int gated)
+{
+	struct timespec t0, t1;
+	double elapsed;
+	int slot = -1, burst, ch, done = 0;
+	pthread_mutex_lock(&adcLock);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if(adcMode == 1)
+	{
+		elapsed = (t0.tv_sec - adcLast.tv_sec) + (t0.tv_nsec - adcLast.tv_nsec) / 1E+9;
+		if(adcForce || (gated && adcRate > 0 && elapsed >= 1 / adcRate))
+		{
+			adcLast = t0;
+			adcForce = 0;
+			adcState = ADC_CAPTURING;
+			adcCaptured = 0;
+			slot = 0;
+		}
+	}
+	else if(adcMode == 2)
+	{
+		if(adcState == ADC_ARMED && (gated || adcForce))
+		{
+			adcForce = 0;
+			adcState = ADC_CAPTURING;
+			adcCaptured = 0;
+		}
+		if(adcState == ADC_CAPTURING)
+			slot = adcCaptured;
+	}
+	if(slot < 0 || slot >= adcRingPulses)
+	{
+		pthread_mutex_unlock(&adcLock);
+		return -1;
+	}
+	for(ch=0; ch<adc_channel_num; ch++)
+		ReadTriggerData(0, ch, AdcSlot(slot, ch));
+	adcStamp[slot] = *stamp;
+	adcCaptured = slot + 1;
+	burst = (adcBurstPulses < adcRingPulses) ? adcBurstPulses : adcRingPulses;
+	if(adcMode == 1 || adcCaptured >= burst)
+	{
+		adcState = ADC_DONE;
+		adcCaptures++;
+		done = 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	adcTimeLast = ((t1.tv_sec - t0.tv_sec) * 1E+9 + (t1.tv_nsec - t0.tv_nsec)) / 1E+6;
+	pthread_mutex_unlock(&adcLock);
+	if(done)
+		scanIoRequest(ADCrawBufferinScanPvt);
+	return slot;
+}
+
+/* REG:54 mode (0 off, 1 continuous, 2 burst), 55 arm, 56 software trigger,
+   57 burst pulses, 58 continuous rate in Hz, 59 slot shown. */
+static void SetADCCapture(int offset, float value)
+{
+	int post = 0;
+	pthread_mutex_lock(&adcLock);
+	switch(offset)
+	{
+		case 54:
+			adcMode = (value >= 0 && value <= 2) ? (int)value : 0;
+			adcState = ADC_IDLE;
+			adcForce = 0;
+			break;
+		case 55:
+			if(adcMode == 2 && value != 0)
+			{
+				adcState = ADC_ARMED;
+				adcForce = 0;
+			}
+			break;
+		case 56:
+			if(adcMode != 0 && value != 0)
+			{
+				if(adcMode == 2)
+					adcState = ADC_ARMED;
+				adcForce = 1;
+			}
+			break;
+		case 57:
+			adcBurstPulses = (value < 1) ? 1 : (value > adcRingPulses) ? adcRingPulses : (int)value;
+			break;
+		case 58:
+			adcRate = value;
+			break;
+		case 59:
+			adcSelect = (value < 0) ? 0 : (int)value;
+			post = (adcCaptured > 0);
+			break;
+		default:
+			break;
+	}
+	pthread_mutex_unlock(&adcLock);
+	if(offset == 54 && (value < 0 || value > 2))
+		DrvLog(DRVLOG_WARN, "Raw ADC capture mode %f unknown, capture off.\n", value);
+	if(post)
+		scanIoRequest(ADCrawBufferinScanPvt);
+}
+
+/* Channel ch of the shown slot of the last capture. Returns -1 if nothing was
+   captured. */
+static int CopyADCRing(int ch, float *data, unsigned int nelem, epicsTimeStamp *stamp)
+{
+	int slot;
+	pthread_mutex_lock(&adcLock);
+	if(adcCaptured == 0)
+	{
+		pthread_mutex_unlock(&adcLock);
+		memset(data, 0, nelem * sizeof(float));
+		return -1;
+	}
+	slot = (adcSelect < adcCaptured) ? adcSelect : adcCaptured - 1;
+	if(nelem > adc_buf_len)
+	{
+		memset(data + adc_buf_len, 0, (nelem - adc_buf_len) * sizeof(float));
+		nelem = adc_buf_len;
+	}
+	memcpy(data, AdcSlot(slot, ch), nelem * sizeof(float));
+	*stamp = adcStamp[slot];
+	pthread_mutex_unlock(&adcLock);
+	return 0;
+}
+
+/* Called by pthread() on every gated frame, after CaptureADC(); slot is what
+   it returned. Only pthread() writes adcRing[], so the slot is copied without
+   adcLock. specRaw is only written while SpectrumThread() waits for it. */
+static void FeedSpectrum(const epicsTimeStamp *stamp, int slot)
+{
+	struct timespec t0, t1;
+	int ch;
+	pthread_mutex_lock(&specLock);
+	ch = specGot ? -1 : specWant;
+	pthread_mutex_unlock(&specLock);
+	if(ch < 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if(slot >= 0)
+		memcpy(specRaw, AdcSlot(slot, ch), sizeof(specRaw));
+	else
+		ReadTriggerData(0, ch, specRaw);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	pthread_mutex_lock(&specLock);
+	if(specWant == ch)
+	{
+		specRawStamp = *stamp;
+		specRawTime = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1E+9;
+		specGot = 1;
+		pthread_cond_signal(&specCond);
+	}
+	pthread_mutex_unlock(&specLock);
+}
+
+static void *SpectrumThread(void *arg)
+{
+	static float spectrum[spec_points];
+	specResult_t res;
+	epicsTimeStamp stamp;
+	struct timespec t0, t1, t2, deadline;
+	double wait, busy, spent, duty, read = 0;
+	int ch = 0, enable, ok, got;
+	float rate, fs, fullScale;
+	if(SpecInit() != 0)
+		return NULL;
+	while(1)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		pthread_mutex_lock(&specLock);
+		enable = specEnable;
+		rate = specRate;
+		duty = specMaxDuty;
+		fs = specSampleRate;
+		fullScale = specFullScale;
+		got = 0;
+		if(enable && rate > 0)
+		{
+			specWant = ch;
+			specGot = 0;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += spec_frame_timeout;
+			while(!specGot && pthread_cond_timedwait(&specCond, &specLock, &deadline) != ETIMEDOUT)
+				;
+			got = specGot;
+			stamp = specRawStamp;
+			read = specRawTime;
+			specWant = -1;
+		}
+		pthread_mutex_unlock(&specLock);
+		wait = (rate > 0) ? 1 / rate : 1;
+		busy = 0;
+		if(got)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			ok = (SpecAnalyze(specRaw, adc_buf_len, fs, fullScale, &res, spectrum, spec_points) == 0);
+			clock_gettime(CLOCK_MONOTONIC, &t2);
+			busy = read + (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1E+9;
+			if(duty > 0 && busy * 100 / duty > wait)
+				wait = busy * 100 / duty;
+			pthread_mutex_lock(&specLock);
+			if(ok)
+			{
+				specResult[ch] = res;
+				memcpy(specWf[ch], spectrum, sizeof(spectrum));
+				specStamp[ch] = stamp;
+			}
+			specTimeLast = busy * 1E+3;
+			specDuty = busy / wait * 100;
+			pthread_mutex_unlock(&specLock);
+			if(ok)
+				scanIoRequest(SpecinScanPvt);
+			ch = (ch + 1) % adc_channel_num;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		spent = (t2.tv_sec - t0.tv_sec) + (t2.tv_nsec - t0.tv_nsec) / 1E+9;
+		if(wait > spent)
+			usleep((useconds_t)((wait - spent) * 1E+6));
+	}
+	return NULL;
+}
+
+/* REG:97-104 ch = ADC channel: SNR, SINAD, SFDR, ENOB, noise floor, fundamental
+   and spur frequency, signal level; 105 time of one raw read and analysis,
+   106 duty. */
+static float GetSpectrum(int offset, int ch)
+{
+	specResult_t res;
+	float val;
+	if(offset < 105 && (ch < 0 || ch >= adc_channel_num))
+		return 0;
+	pthread_mutex_lock(&specLock);
+	if(offset < 105)
+		res = specResult[ch];
+	val = (offset == 105) ? specTimeLast : specDuty;
+	pthread_mutex_unlock(&specLock);
+	switch(offset)
+	{
+		case 97: return res.snr;
+		case 98: return res.sinad;
+		case 99: return res.sfdr;
+		case 100: return res.enob;
+		case 101: return res.noiseFloor;
+		case 102: return res.fundFreq;
+		case 103: return res.spurFreq;
+		case 104: return res.signal;
+		default: return val;
+	}
+}
+
+/* REG:60 enable, 61 channels per second, 62 CPU duty limit in percent
+   (0 no limit, at most 100), 63 ADC sample rate in MHz, 64 full scale in counts. */
+static void SetSpectrum(int offset, float value)
+{
+	pthread_mutex_lock(&specLock);
+	switch(offset)
+	{
+		case 60: specEnable = (value != 0); break;
+		case 61: specRate = (value < 0) ? 0 : value; break;
+		case 62: specMaxDuty = (value < 0) ? 0 : ((value > 100) ? 100 : value); break;
+		case 63: if(value > 0) specSampleRate = value; break;
+		case 64: if(value > 0) specFullScale = value; break;
+		default: break;
+	}
+	pthread_mutex_unlock(&specLock);
+}
+
+/* Called by SnapshotThread() once a second, asks device support for the
+   monitor counts. Device support takes the scan lock of each record, so this
+   stays off the acquisition thread. */
+static void UpdateDemand(void)
+{
+	if(demandHook != NULL)
+		demandHook();
+}
+
+static float GetPreview(int type, int index)
+{
+	preview_t res;
+	if(index < 0 || index >= preview_num)
+		return 0;
+	pthread_mutex_lock(&previewLock);
+	res = previewResult[index];
+	pthread_mutex_unlock(&previewLock);
+	if(type == 51)
+		return res.firstIndex;
+	else if(type == 52)
+		return res.count;
+	return res.peak;
+}
+
+static int ProcConfigPendingValid(void)
+{
+	int valid;
+	pthread_mutex_lock(&cfgLock);
+	valid = pendingCfgValid;
+	pthread_mutex_unlock(&cfgLock);
+	return valid;
+}
+
+// Clip a window to the waveform length, return the number of points in it.
+static int WindowPoints(int *start, int *stop, int length)
+{
+	if(*stop >= length)
+		*stop = length - 1;
+	if(*start < 0)
+		*start = 0;
+	if(*stop < *start)
+		return 0;
+	return (*stop - *start + 1);
+}
+
+// Calibration setpoints, power offsets, pulse mode and windows; only these are
+// cached and saved in the snapshot. Outputs (DO, pulse, triggers, DDS mode,
+// LEDs) and commands (sync IQ, history trigger, resets, CSV reload) always go
+// to hardware and keep their db VAL at boot.
+static int IsShadowedReg(int offset)
+{
+	switch(offset)
+	{
+		case 8:
+		case 10: case 11: case 12: case 13: case 14: case 15: case 16: case 18:
+		case 19: case 20: case 21: case 22: case 27: case 28:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Read a written register back where liblowlevel.so has a getter for it, only
+// the front panel LEDs so far. A shadowed register that reads back wrong is
+// left invalid, so the next write of the same value goes to hardware again.
+static int VerifyReg(int offset, int channel, float val)
+{
+	int rbk;
+	if(ReplayMode() == replay_mode_replay)
+		return 0;
+	switch(offset)
+	{
+		case 24:
+			rbk = funcGetFPGA_LED0_RBK();
+			break;
+		case 25:
+			rbk = funcGetFPGA_LED1_RBK();
+			break;
+		default:
+			return 0;
+	}
+	if(rbk == (int)val)
+		return 0;
+	__atomic_add_fetch(&regReadbackErrors, 1, __ATOMIC_RELAXED);
+	DrvLog(DRVLOG_WARN, "REG:%d ch=%d reads back %d after writing %d.\n", offset, channel, rbk, (int)val);
+	return -1;
+}
+
+// k1/k2/k3, phase offsets, kxy/ksum, xy offsets, xy and sum limits, filter time.
+static int IsCalibrationReg(int offset)
+{
+	return ((offset >= 10 && offset <= 16) || offset == 18 || offset == 22);
+}
+
+static void BeginCalTransaction(void)
+{
+	pthread_mutex_lock(&hwLock);
+	calTransaction = 1;
+	pthread_mutex_unlock(&hwLock);
+	DrvLog(DRVLOG_INFO, "Calibration transaction started, calibration writes are staged.\n");
+}
+
+// Write every staged calibration value in one pass. hwLock is held for the
+// whole batch, so no other SetReg() write lands in the middle of it.
+static void CommitCalTransaction(void)
+{
+	int offset, channel;
+	int applied=0, skipped=0;
+	struct timespec t0, t1;
+	shadowReg_t *reg;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_mutex_lock(&hwLock);
+	if(!calTransaction)
+	{
+		pthread_mutex_unlock(&hwLock);
+		return;
+	}
+	for(offset=0; offset<shadow_reg_num; offset++)
+	{
+		for(channel=0; channel<shadow_ch_num; channel++)
+		{
+			reg = &shadowRegs[offset][channel];
+			if(!reg->dirty)
+				continue;
+			if(reg->valid && reg->value == reg->staged)
+			{
+				skipped++;
+			}else{
+				ApplyReg(offset, channel, reg->staged);
+				reg->value = reg->staged;
+				reg->valid = (VerifyReg(offset, channel, reg->staged) == 0);
+				applied++;
+			}
+			reg->dirty = 0;
+		}
+	}
+	regWritesApplied += applied;
+	regWritesSkipped += skipped;
+	calStagedWrites = 0;
+	calTransaction = 0;
+	if(applied > 0)
+		MarkSnapshotDirty();
+	pthread_mutex_unlock(&hwLock);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	DrvLog(DRVLOG_INFO, "Calibration transaction committed: %d written, %d unchanged, %.3f ms.\n", applied, skipped,
+		(t1.tv_sec - t0.tv_sec)*1E+3 + (t1.tv_nsec - t0.tv_nsec)/1E+6);
+}
+
+static void AbortCalTransaction(void)
+{
+	int offset, channel;
+	pthread_mutex_lock(&hwLock);
+	for(offset=0; offset<shadow_reg_num; offset++)
+		for(channel=0; channel<shadow_ch_num; channel++)
+			shadowRegs[offset][channel].dirty = 0;
+	calStagedWrites = 0;
+	calTransaction = 0;
+	pthread_mutex_unlock(&hwLock);
+	DrvLog(DRVLOG_INFO, "Calibration transaction aborted, staged writes discarded.\n");
+}
+
+static long ReportDevice(int level)
+{
+	int offset, channel;
+	shadowReg_t *reg;
+	printf("BPMmonitor driver: %u register writes applied, %u skipped as unchanged, %u read-back errors\n", regWritesApplied, regWritesSkipped, regReadbackErrors);
+	printf("  calibration transaction %s, %d staged writes\n", calTransaction ? "open" : "closed", calStagedWrites);
+	ReportJitter();
+	ReplayReport();
+	if(level < 1)
+		return 0;
+	pthread_mutex_lock(&hwLock);
+	for(offset=0; offset<shadow_reg_num; offset++)
+	{
+		for(channel=0; channel<shadow_ch_num; channel++)
+		{
+			reg = &shadowRegs[offset][channel];
+			if(!reg->valid && !reg->dirty)
+				continue;
+			printf("  REG:%d ch=%d value=%g", offset, channel, reg->value);
+			if(reg->dirty)
+				printf(" staged=%g", reg->staged);
+			printf("\n");
+		}
+	}
+	pthread_mutex_unlock(&hwLock);
+	return 0;
+}
+
+static void MarkSnapshotDirty(void)
+{
+	__atomic_store_n(&snapshotDirty, 1, __ATOMIC_RELEASE);
+}
+
+static U32 SnapshotChecksum(const unsigned char *data, size_t len)
+{
+	U32 hash = 2166136261u;
+	size_t i;
+	for(i=0; i<len; i++)
+	{
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Write the snapshot to a temporary file and rename it, so a power cut during
+// the write leaves the previous snapshot intact.
+static int SaveSnapshot(void)
+{
+	snapshotHeader_t header;
+	snapshotEntry_t entries[shadow_reg_num*shadow_ch_num];
+	unsigned char *body;
+	size_t entriesLen, tableLen;
+	char tmpPath[sizeof(snapshotPath)+4];
+	int offset, channel, count=0, rows, columns;
+	FILE *fp;
+
+	if(snapshotPath[0] == '\0')
+		return 0;
+	body = malloc(sizeof(entries) + cal_max_rows*cal_max_columns*sizeof(double));
+	if(body == NULL)
+		return -1;
+	snapshotCalVersion = CalStoreVersion();
+	pthread_mutex_lock(&hwLock);
+	for(offset=0; offset<shadow_reg_num; offset++)
+	{
+		for(channel=0; channel<shadow_ch_num; channel++)
+		{
+			if(!shadowRegs[offset][channel].valid)
+				continue;
+			entries[count].offset = offset;
+			entries[count].channel = channel;
+			entries[count].value = shadowRegs[offset][channel].value;
+			count++;
+		}
+	}
+	pthread_mutex_unlock(&hwLock);
+
+	entriesLen = count*sizeof(snapshotEntry_t);
+	memcpy(body, entries, entriesLen);
+	CalStoreExport((double *)(body + entriesLen), cal_max_rows*cal_max_columns, &rows, &columns);
+	tableLen = rows*columns*sizeof(double);
+
+	header.magic = snapshot_magic;
+	header.version = snapshot_version;
+	header.count = count;
+	header.rows = rows;
+	header.columns = columns;
+	header.checksum = SnapshotChecksum(body, entriesLen + tableLen);
+
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", snapshotPath);
+	fp = fopen(tmpPath, "wb");
+	if(fp == NULL)
+	{
+		free(body);
+		return -1;
+	}
+	if(fwrite(&header, sizeof(header), 1, fp) != 1 || fwrite(body, entriesLen + tableLen, 1, fp) != 1)
+	{
+		fclose(fp);
+		free(body);
+		return -1;
+	}
+	fflush(fp);
+	fsync(fileno(fp));
+	fclose(fp);
+	free(body);
+	return rename(tmpPath, snapshotPath);
+}
+
+// Apply all setpoints of the snapshot in one batch, before the records are
+// initialized. init_record_ao/bo then pick the restored values up, so PINI
+// writes the same values and the shadow registers skip them.
+static int RestoreSnapshot(void)
+{
+	snapshotHeader_t header;
+	snapshotEntry_t *entries;
+	unsigned char *body;
+	size_t entriesLen, tableLen;
+	struct timespec t0, t1;
+	shadowReg_t *reg;
+	U32 i;
+	FILE *fp;
+
+	if(snapshotPath[0] == '\0')
+		return -1;
+	fp = fopen(snapshotPath, "rb");
+	if(fp == NULL)
+	{
+		printf("No setpoint snapshot %s, cold start.\n", snapshotPath);
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if(fread(&header, sizeof(header), 1, fp) != 1 || header.magic != snapshot_magic
+		|| header.version != snapshot_version || header.count > shadow_reg_num*shadow_ch_num
+		|| header.rows > cal_max_rows || header.columns > cal_max_columns)
+	{
+		fclose(fp);
+		printf("Setpoint snapshot %s has a wrong format, ignored.\n", snapshotPath);
+		return -1;
+	}
+	entriesLen = header.count*sizeof(snapshotEntry_t);
+	tableLen = header.rows*header.columns*sizeof(double);
+	body = malloc(entriesLen + tableLen + 1);
+	if(body == NULL || fread(body, entriesLen + tableLen, 1, fp) != 1
+		|| SnapshotChecksum(body, entriesLen + tableLen) != header.checksum)
+	{
+		fclose(fp);
+		free(body);
+		printf("Setpoint snapshot %s is truncated or corrupted, ignored.\n", snapshotPath);
+		return -1;
+	}
+	fclose(fp);
+
+	entries = (snapshotEntry_t *)body;
+	/* Used until the calibration store has read the file itself. */
+	if(header.rows > 0)
+		CalStoreImport((const double *)(body + entriesLen), header.rows, header.columns);
+	pthread_mutex_lock(&hwLock);
+	for(i=0; i<header.count; i++)
+	{
+		if(entries[i].offset >= shadow_reg_num || entries[i].channel >= shadow_ch_num
+			|| !IsShadowedReg(entries[i].offset))
+			continue;
+		ApplyReg(entries[i].offset, entries[i].channel, entries[i].value);
+		reg = &shadowRegs[entries[i].offset][entries[i].channel];
+		reg->value = entries[i].value;
+		reg->valid = (VerifyReg(entries[i].offset, entries[i].channel, entries[i].value) == 0);
+		snapshotRestored++;
+	}
+	pthread_mutex_unlock(&hwLock);
+	free(body);
+	LatchProcConfig();
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	snapshotRestoreTime = (t1.tv_sec - t0.tv_sec)*1E+3 + (t1.tv_nsec - t0.tv_nsec)/1E+6;
+	printf("Restored %d setpoints from %s in %.3f ms.\n", snapshotRestored, snapshotPath, snapshotRestoreTime);
+	return 0;
+}
+
+static void *SnapshotThread(void *arg)
+{
+	while(1)
+	{
+		sleep(1);
+		UpdateDemand();
+		if(__atomic_exchange_n(&snapshotDirty, 0, __ATOMIC_ACQ_REL) == 0
+			&& CalStoreVersion() == snapshotCalVersion)
+			continue;
+		if(SaveSnapshot() != 0)
+		{
+			DrvLog(DRVLOG_ERROR, "Failed to write setpoint snapshot %s.\n", snapshotPath);
+		}
+	}
+	return NULL;
+}
+
+// Report how long the IOC took to come up, from process start and from InitDevice.
+static void StartupTimeHook(initHookState state)
+{
+	struct timespec now, boot;
+	double sinceInit, sinceStart;
+	unsigned long long startTicks = 0;
+	char buffer[1024], *p;
+	FILE *fp;
+	int i;
+
+	if(state != initHookAfterIocRunning)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	sinceInit = (now.tv_sec - initDeviceTime.tv_sec) + (now.tv_nsec - initDeviceTime.tv_nsec)/1E+9;
+	sinceStart = sinceInit;
+	/* Field 22 of /proc/self/stat is the process start time in clock ticks since boot. */
+	fp = fopen("/proc/self/stat", "r");
+	if(fp != NULL)
+	{
+		if(fgets(buffer, sizeof(buffer), fp) != NULL && (p = strrchr(buffer, ')')) != NULL)
+		{
+			for(i=2; i<22 && p != NULL; i++)
+				p = strchr(p + 1, ' ');
+			if(p != NULL)
+				startTicks = strtoull(p + 1, NULL, 10);
+		}
+		fclose(fp);
+	}
+	if(startTicks > 0 && clock_gettime(CLOCK_BOOTTIME, &boot) == 0)
+		sinceStart = (boot.tv_sec + boot.tv_nsec/1E+9) - (double)startTicks/sysconf(_SC_CLK_TCK);
+	iocStartupTime = sinceStart;
+	DrvLog(DRVLOG_INFO, "IOC startup took %.3f s (%.3f s since InitDevice, %d setpoints restored in %.3f ms).\n",
+		sinceStart, sinceInit, snapshotRestored, snapshotRestoreTime);
+}
+
+/* "2" or "1,3" or "2-3" */
+static int ParseCpuList(const char *list, cpu_set_t *set)
+{
+	const char *p = list;
+	char *end;
+	long first, last, cpu;
+	int count=0;
+	CPU_ZERO(set);
+	while(p != NULL && *p != '\0')
+	{
+		first = strtol(p, &end, 10);
+		if(end == p)
+			return -1;
+		last = first;
+		if(*end == '-')
+		{
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if(end == p)
+				return -1;
+		}
+		if(first < 0 || last < first || last >= CPU_SETSIZE)
+			return -1;
+		for(cpu=first; cpu<=last; cpu++)
+		{
+			CPU_SET(cpu, set);
+			count++;
+		}
+		if(*end == ',')
+			end++;
+		else if(*end != '\0')
+			return -1;
+		p = end;
+	}
+	return count;
+}
+
+/* Thread with the policy of BPMRealTime() at the given priority. Falls back
+   to default scheduling if the attributes are refused and returns 1 then. */
+static int CreateRtThread(void *(*func)(void *), int priority, int cpusSet, cpu_set_t *cpus)
+{
+	pthread_t tid;
+	pthread_attr_t attr;
+	struct sched_param param;
+	int status;
+
+	pthread_attr_init(&attr);
+	if(rtPolicy != SCHED_OTHER)
+	{
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, rtPolicy);
+		param.sched_priority = priority;
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	if(cpusSet)
+		pthread_attr_setaffinity_np(&attr, sizeof(*cpus), cpus);
+	status = pthread_create(&tid, &attr, func, NULL);
+	pthread_attr_destroy(&attr);
+	if(status == 0)
+		return 0;
+	if(rtPolicy != SCHED_OTHER || cpusSet)
+	{
+		DrvLog(DRVLOG_WARN, "Real-time thread not created (%s), using default scheduling.\n", strerror(status));
+		if(pthread_create(&tid, NULL, func, NULL) == 0)
+			return 1;
+	}
+	return -1;
+}
+
+static int CreateAcqThread(void)
+{
+	int status;
+
+	if(rtLockMemory)
+	{
+		/* Locks and faults in every page mapped now (the frame buffers are
+		   static) and every page mapped later (record buffers at iocInit). */
+		if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+			DrvLog(DRVLOG_WARN, "mlockall failed (%s), memory is not locked.\n", strerror(errno));
+	}
+	status = CreateRtThread(pthread, rtPriority, rtCpusSet, &rtCpus);
+	if(status < 0)
+		return -1;
+	rtActive = (status == 0 && (rtPolicy != SCHED_OTHER || rtCpusSet));
+	if(rtActive)
+		printf("Acquisition thread: policy %d priority %d%s%s\n", rtPolicy, rtPriority,
+			rtCpusSet ? ", pinned" : "", rtLockMemory ? ", memory locked" : "");
+	return 0;
+}
+
+/* Touch the stack the acquisition loop will use, so it never faults later. */
+static void PrefaultStack(void)
+{
+	volatile char stack[64*1024];
+	unsigned int i;
+	for(i=0; i<sizeof(stack); i+=256)
+		stack[i] = 0;
+}
+
+/* Sleep of the acquisition loop to an absolute deadline; the time past the
+   deadline when the thread runs again is the wakeup latency. */
+static void AcqSleep(int us)
+{
+	struct timespec deadline, now;
+	float late;
+	unsigned int i;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += us / 1000000;
+	deadline.tv_nsec += (us % 1000000) * 1000;
+	if(deadline.tv_nsec >= 1000000000)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+		;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	late = ((now.tv_sec - deadline.tv_sec) * 1E+9 + (now.tv_nsec - deadline.tv_nsec)) / 1E+3;
+	if(late < 0)
+		late = 0;
+	for(i=0; i<jitter_bucket_num-1 && late >= jitterBounds[i]; i++)
+		;
+	jitterHist[i]++;
+	jitterLast = late;
+	if(late > jitterMax)
+		jitterMax = late;
+}
+
+static void ResetJitter(void)
+{
+	memset(jitterHist, 0, sizeof(jitterHist));
+	jitterMax = 0;
+	procTimeMax = 0;
+}
+
+static void ReportJitter(void)
+{
+	unsigned int i;
+	printf("  acquisition thread %s, wakeup latency last %.1f us, max %.1f us\n",
+		rtActive ? "real-time" : "default scheduling", jitterLast, jitterMax);
+	printf("  %d worker thread(s), frame processing last %.1f us, max %.1f us\n",
+		poolSize, procTimeLast, procTimeMax);
+	for(i=0; i<jitter_bucket_num; i++)
+	{
+		if(i < jitter_bucket_num-1)
+			printf("    < %5d us: %u\n", jitterBounds[i], jitterHist[i]);
+		else
+			printf("    >=%5d us: %u\n", jitterBounds[i-1], jitterHist[i]);
+	}
+}
+
+static const iocshArg snapshotFileArg0 = {"path", iocshArgString};
+static const iocshArg * const snapshotFileArgs[] = {&snapshotFileArg0};
+static const iocshFuncDef snapshotFileFuncDef = {"BPMSetSnapshotFile", 1, snapshotFileArgs};
+static void snapshotFileCallFunc(const iocshArgBuf *args)
+{
+	if(args[0].sval == NULL)
+		snapshotPath[0] = '\0';
+	else
+		snprintf(snapshotPath, sizeof(snapshotPath), "%s", args[0].sval);
+}
+
+static const iocshArg calibrationFileArg0 = {"path", iocshArgString};
+static const iocshArg * const calibrationFileArgs[] = {&calibrationFileArg0};
+static const iocshFuncDef calibrationFileFuncDef = {"BPMSetCalibrationFile", 1, calibrationFileArgs};
+static void calibrationFileCallFunc(const iocshArgBuf *args)
+{
+	if(args[0].sval != NULL)
+		snprintf(calFilePath, sizeof(calFilePath), "%s", args[0].sval);
+}
+
+static const iocshArg logConfigArg0 = {"level(0=debug,1=info,2=warn,3=error)", iocshArgInt};
+static const iocshArg logConfigArg1 = {"lines per second per message", iocshArgInt};
+static const iocshArg logConfigArg2 = {"file, empty for console", iocshArgString};
+static const iocshArg * const logConfigArgs[] = {&logConfigArg0, &logConfigArg1, &logConfigArg2};
+static const iocshFuncDef logConfigFuncDef = {"BPMLogConfig", 3, logConfigArgs};
+static void logConfigCallFunc(const iocshArgBuf *args)
+{
+	DrvLogSetLevel(args[0].ival);
+	DrvLogSetRateLimit(args[1].ival);
+	DrvLogSetFile(args[2].sval);
+}
+
+static const iocshArg realTimeArg0 = {"policy (fifo, rr, other)", iocshArgString};
+static const iocshArg realTimeArg1 = {"priority", iocshArgInt};
+static const iocshArg realTimeArg2 = {"cpus, e.g. 1 or 2-3, empty for all", iocshArgString};
+static const iocshArg realTimeArg3 = {"lock memory (0/1)", iocshArgInt};
+static const iocshArg * const realTimeArgs[] = {&realTimeArg0, &realTimeArg1, &realTimeArg2, &realTimeArg3};
+static const iocshFuncDef realTimeFuncDef = {"BPMRealTime", 4, realTimeArgs};
+static void realTimeCallFunc(const iocshArgBuf *args)
+{
+	const char *policy = args[0].sval ? args[0].sval : "other";
+	if(strcmp(policy, "fifo") == 0)
+		rtPolicy = SCHED_FIFO;
+	else if(strcmp(policy, "rr") == 0)
+		rtPolicy = SCHED_RR;
+	else if(strcmp(policy, "other") == 0)
+		rtPolicy = SCHED_OTHER;
+	else
+	{
+		printf("BPMRealTime: unknown policy %s\n", policy);
+		return;
+	}
+	rtPriority = (rtPolicy == SCHED_OTHER) ? 0 : args[1].ival;
+	if(rtPolicy != SCHED_OTHER &&
+	   (rtPriority < sched_get_priority_min(rtPolicy) || rtPriority > sched_get_priority_max(rtPolicy)))
+	{
+		printf("BPMRealTime: priority %d out of range %d-%d\n", rtPriority,
+			sched_get_priority_min(rtPolicy), sched_get_priority_max(rtPolicy));
+		rtPolicy = SCHED_OTHER;
+		rtPriority = 0;
+		return;
+	}
+	rtCpusSet = 0;
+	if(args[2].sval != NULL && args[2].sval[0] != '\0')
+	{
+		if(ParseCpuList(args[2].sval, &rtCpus) <= 0)
+			printf("BPMRealTime: bad cpu list %s, affinity not set\n", args[2].sval);
+		else
+			rtCpusSet = 1;
+	}
+	rtLockMemory = args[3].ival;
+}
+
+static const iocshArg workerPoolArg0 = {"worker threads", iocshArgInt};
+static const iocshArg workerPoolArg1 = {"priority (with BPMRealTime fifo/rr)", iocshArgInt};
+static const iocshArg workerPoolArg2 = {"cpus, e.g. 2-3, empty for all", iocshArgString};
+static const iocshArg * const workerPoolArgs[] = {&workerPoolArg0, &workerPoolArg1, &workerPoolArg2};
+static const iocshFuncDef workerPoolFuncDef = {"BPMWorkerPool", 3, workerPoolArgs};
+static void workerPoolCallFunc(const iocshArgBuf *args)
+{
+	poolSize = args[0].ival;
+	if(poolSize < 0)
+		poolSize = 0;
+	if(poolSize > max_workers)
+		poolSize = max_workers;
+	poolPriority = args[1].ival;
+	poolCpusSet = 0;
+	if(args[2].sval != NULL && args[2].sval[0] != '\0')
+	{
+		if(ParseCpuList(args[2].sval, &poolCpus) <= 0)
+			printf("BPMWorkerPool: bad cpu list %s, affinity not set\n", args[2].sval);
+		else
+			poolCpusSet = 1;
+	}
+}
+
+static const iocshArg positionMapArg0 = {"bpm (1 or 2)", iocshArgInt};
+static const iocshArg positionMapArg1 = {"map file, empty to remove", iocshArgString};
+static const iocshArg * const positionMapArgs[] = {&positionMapArg0, &positionMapArg1};
+static const iocshFuncDef positionMapFuncDef = {"BPMPositionMap", 2, positionMapArgs};
+static void positionMapCallFunc(const iocshArgBuf *args)
+{
+	int bpm = args[0].ival - 1;
+	if(bpm < 0 || bpm >= pos_map_bpm_num)
+	{
+		printf("BPMPositionMap: bpm must be 1 or 2\n");
+		return;
+	}
+	if(args[1].sval == NULL || args[1].sval[0] == '\0')
+		PosMapClear(bpm);
+	else
+		PosMapLoad(bpm, args[1].sval);
+}
+
+static const iocshArg adcCaptureArg0 = {"raw ADC ring pulses", iocshArgInt};
+static const iocshArg * const adcCaptureArgs[] = {&adcCaptureArg0};
+static const iocshFuncDef adcCaptureFuncDef = {"BPMADCCapture", 1, adcCaptureArgs};
+static void adcCaptureCallFunc(const iocshArgBuf *args)
+{
+	if(adcRingFixed)
+	{
+		printf("BPMADCCapture: the ring is allocated at iocInit, keeping %d pulses\n", adcRingPulses);
+		return;
+	}
+	adcRingPulses = args[0].ival;
+	if(adcRingPulses < 0)
+		adcRingPulses = 0;
+	if(adcRingPulses > adc_ring_max)
+		adcRingPulses = adc_ring_max;
+}
+
+static const iocshArg replayArg0 = {"recording, empty for the hardware", iocshArgString};
+static const iocshArg replayArg1 = {"speed (1 recorded pace, 0 as fast as possible)", iocshArgDouble};
+static const iocshArg replayArg2 = {"loop (0/1)", iocshArgInt};
+static const iocshArg * const replayArgs[] = {&replayArg0, &replayArg1, &replayArg2};
+static const iocshFuncDef replayFuncDef = {"BPMReplay", 3, replayArgs};
+static void replayCallFunc(const iocshArgBuf *args)
+{
+	ReplayConfig(args[0].sval, args[1].dval, args[2].ival);
+}
+
+static const iocshArg recordArg0 = {"recording, empty for none", iocshArgString};
+static const iocshArg recordArg1 = {"frames, 0 for no limit", iocshArgInt};
+static const iocshArg * const recordArgs[] = {&recordArg0, &recordArg1};
+static const iocshFuncDef recordFuncDef = {"BPMRecord", 2, recordArgs};
+static void recordCallFunc(const iocshArgBuf *args)
+{
+	RecordConfig(args[0].sval, (args[1].ival > 0) ? args[1].ival : 0);
+}
+
+static const iocshFuncDef jitterReportFuncDef = {"BPMJitterReport", 0, NULL};
+static void jitterReportCallFunc(const iocshArgBuf *args)
+{
+	ReportJitter();
+}
+
+static void BPMmonitorRegistrar(void)
+{
+	DrvLogInit();
+	iocshRegister(&realTimeFuncDef, realTimeCallFunc);
+	iocshRegister(&workerPoolFuncDef, workerPoolCallFunc);
+	iocshRegister(&positionMapFuncDef, positionMapCallFunc);
+	iocshRegister(&adcCaptureFuncDef, adcCaptureCallFunc);
+	iocshRegister(&replayFuncDef, replayCallFunc);
+	iocshRegister(&recordFuncDef, recordCallFunc);
+	iocshRegister(&jitterReportFuncDef, jitterReportCallFunc);
+	iocshRegister(&logConfigFuncDef, logConfigCallFunc);
+	iocshRegister(&snapshotFileFuncDef, snapshotFileCallFunc);
+	iocshRegister(&calibrationFileFuncDef, calibrationFileCallFunc);
+}
+epicsExportRegistrar(BPMmonitorRegistrar);
@@ -1,28 +1,53 @@
 /* driverWrapper.h */
 /* Author:  Gao    Create Date:  01Nov2021 */
-/* The last modified date:  16Dec2021 */
+/* The last modified date:  19Oct2026 */
 
 #ifndef _driverWrapper_H
 #define _driverWrapper_H
 
 #include <dbScan.h>
+#include <epicsTime.h>
 
 /* The following functions will be called from upper layer.**************/
 IOSCANPVT devGetInTrigScanPvt();
 
+IOSCANPVT devGetInTrigChannelScanPvt(int offset);
+
+IOSCANPVT devGetInScalarScanPvt();
+
+IOSCANPVT devGetInScalarChannelScanPvt(int offset);
+
 IOSCANPVT devGetInTripBufferScanPvt();
 
 IOSCANPVT devGetInADCrawBufferScanPvt();
 
+void SetDemandHook(void (*hook)(void));
+
+void SetWaveformDemand(int offset, int records, int monitors);
+
 void* pthread();
 
 float ReadData(int offset, int channel, int type);
 
 void SetReg(int offset, int channel, float val);
 
+int GetRestoredReg(int offset, int channel, float *val);
+
+unsigned int GetFrameTime(epicsTimeStamp *stamp);
+
+int GetStatusTime(int offset, int channel, epicsTimeStamp *stamp);
+
 // void readWaveform(int offset, int ch_N, unsigned int nelem, float* data);
 void readWaveform(int offset, int ch_N, unsigned int nelem, float* data, long long *TAI_S, int *TAI_nS);
 
+float *AcquireWaveform(int offset, int ch_N, unsigned int *nelem, long long *TAI_S, int *TAI_nS);
+
+void ReleaseWaveform(float *data);
+
+int readWaveformCounts(int offset, int ch_N, unsigned int nelem, void *data, int width, long long *TAI_S, int *TAI_nS);
+
+int readFrameWaveform(void *buf, unsigned int maxBytes, unsigned int *nBytes, epicsTimeStamp *stamp);
+
 void  Getparameters(int row,int column,double* data);
 
 double amp2power(float amp, int ch_N);
@@ -0,0 +1,151 @@
+/* frameBuffer.c */
+/* Reference counted sample buffers shared by the driver and the waveform records */
+/* Author:  Gao    Create Date:  19Oct2026 */
+/* The last modified date:  19Oct2026 */
+
+/* A pool hands out float buffers of one length. The driver takes a buffer,
+   fills it with a converted channel and publishes it in place of the previous
+   one; a waveform record takes a reference and points its BPTR at the buffer,
+   so the samples are never copied into the record. A buffer goes back to the
+   free list of its pool when the last reference is dropped. A pool grows when
+   it runs out, which only happens until every record holds one buffer. */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "frameBuffer.h"
+#include "driverLog.h"
+
+typedef struct frameBuf {
+	struct frameBuf *next;	// free list
+	int pool;
+	int refs;
+	float data[];
+}frameBuf_t;
+
+typedef struct {
+	unsigned int length;
+	frameBuf_t *free;
+	unsigned int allocated;
+	unsigned int inUse;
+}framePool_t;
+
+static pthread_mutex_t frameBufLock = PTHREAD_MUTEX_INITIALIZER;
+static framePool_t pools[frame_pool_max];
+static int poolCount=0;
+
+static frameBuf_t *NewBuffer(int pool);
+
+static frameBuf_t *Header(const float *data)
+{
+	return (frameBuf_t *)((char *)data - offsetof(frameBuf_t, data));
+}
+
+/* Returns the pool id, or -1. prealloc buffers are allocated up front. */
+int FrameBufPoolCreate(unsigned int length, int prealloc)
+{
+	int pool, i;
+	frameBuf_t *buf;
+	pthread_mutex_lock(&frameBufLock);
+	if(poolCount >= frame_pool_max)
+	{
+		pthread_mutex_unlock(&frameBufLock);
+		DrvLog(DRVLOG_ERROR, "Too many frame buffer pools, at most %d.\n", frame_pool_max);
+		return -1;
+	}
+	pool = poolCount++;
+	pools[pool].length = length;
+	for(i=0; i<prealloc; i++)
+	{
+		buf = NewBuffer(pool);
+		if(buf == NULL)
+			break;
+		buf->next = pools[pool].free;
+		pools[pool].free = buf;
+	}
+	pthread_mutex_unlock(&frameBufLock);
+	return pool;
+}
+
+/* Called with frameBufLock held. */
+static frameBuf_t *NewBuffer(int pool)
+{
+	frameBuf_t *buf;
+	buf = malloc(sizeof(frameBuf_t) + pools[pool].length * sizeof(float));
+	if(buf == NULL)
+	{
+		DrvLog(DRVLOG_ERROR, "Can't allocate a frame buffer of %u samples.\n", pools[pool].length);
+		return NULL;
+	}
+	buf->next = NULL;
+	buf->pool = pool;
+	buf->refs = 0;
+	pools[pool].allocated++;
+	return buf;
+}
+
+/* A free buffer with one reference, contents undefined. NULL if out of memory. */
+float *FrameBufTake(int pool)
+{
+	frameBuf_t *buf;
+	if(pool < 0 || pool >= poolCount)
+		return NULL;
+	pthread_mutex_lock(&frameBufLock);
+	buf = pools[pool].free;
+	if(buf != NULL)
+		pools[pool].free = buf->next;
+	else
+		buf = NewBuffer(pool);
+	if(buf != NULL)
+	{
+		buf->next = NULL;
+		buf->refs = 1;
+		pools[pool].inUse++;
+	}
+	pthread_mutex_unlock(&frameBufLock);
+	return (buf != NULL) ? buf->data : NULL;
+}
+
+void FrameBufRef(float *data)
+{
+	if(data == NULL)
+		return;
+	pthread_mutex_lock(&frameBufLock);
+	Header(data)->refs++;
+	pthread_mutex_unlock(&frameBufLock);
+}
+
+void FrameBufRelease(float *data)
+{
+	frameBuf_t *buf;
+	if(data == NULL)
+		return;
+	buf = Header(data);
+	pthread_mutex_lock(&frameBufLock);
+	if(--buf->refs == 0)
+	{
+		buf->next = pools[buf->pool].free;
+		pools[buf->pool].free = buf;
+		pools[buf->pool].inUse--;
+	}
+	pthread_mutex_unlock(&frameBufLock);
+}
+
+unsigned int FrameBufLength(const float *data)
+{
+	return (data != NULL) ? pools[Header(data)->pool].length : 0;
+}
+
+void FrameBufStats(int pool, unsigned int *allocated, unsigned int *inUse)
+{
+	*allocated = 0;
+	*inUse = 0;
+	if(pool < 0 || pool >= poolCount)
+		return;
+	pthread_mutex_lock(&frameBufLock);
+	*allocated = pools[pool].allocated;
+	*inUse = pools[pool].inUse;
+	pthread_mutex_unlock(&frameBufLock);
+}
@@ -0,0 +1,23 @@
+/* frameBuffer.h */
+/* Author:  Gao    Create Date:  19Oct2026 */
+/* The last modified date:  19Oct2026 */
+
+#ifndef _frameBuffer_H
+#define _frameBuffer_H
+
+#define frame_pool_max 4
+
+/* The following functions will be called from driver layer.**************/
+int FrameBufPoolCreate(unsigned int length, int prealloc);
+
+float *FrameBufTake(int pool);
+
+void FrameBufRef(float *data);
+
+void FrameBufRelease(float *data);
+
+unsigned int FrameBufLength(const float *data);
+
+void FrameBufStats(int pool, unsigned int *allocated, unsigned int *inUse);
+
+#endif
@@ -0,0 +1,729 @@
+/* lowLevelReplay.c */
+/* Record the liblowlevel traffic of the driver and play it back in place of the hardware */
+/* Author:  Gao    Create Date:  19Oct2026 */
+/* The last modified date:  19Oct2026 */
+
+/* InitDevice() binds every liblowlevel entry point through ReplaySymbol().
+   Without BPMReplay/BPMRecord that is the library function itself.
+
+   In record mode the data and status entry points are wrapped. Each frame
+   (TriggerAllDataReached), trigger channel, frame timestamp, history upload,
+   history channel and status value the driver reads is appended to the
+   recording as it is read, a status value only when it changed. Setters are
+   not recorded, the recording holds what the hardware delivered.
+
+   In replay mode the library is not opened, the stand-ins play a recording
+   back through the same entry points:
+   - TriggerAllDataReached() applies the records up to the next frame, each at
+     its recorded time divided by the speed (speed 0: at once), and returns.
+   - GetTriggerAllData() and GetHistoryChannelData() return the last recorded
+     samples of the channel, zeros if there are none.
+   - GetTimestampData() returns the recorded stamp of the frame, both channels.
+   - HistoryChannelDataReached() waits for the next history upload of the
+     recording, GetHistoryChannelData() for its channel of that upload.
+   - The status getters return the recorded values, the setters do nothing.
+   The frames and their samples replay identically at any speed. Status edges
+   reach the driver through its status poll, at speeds above 1 a short one can
+   be missed.
+
+   The file is a replayHeader_t followed by replayRecord_t records in the
+   byte order of the recording machine, each followed by length floats. */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "lowLevelReplay.h"
+#include "driverLog.h"
+
+#define replay_magic 0x52504d42	// "BPMR"
+#define replay_version 1
+
+#define replay_sel_num 2	// GetTriggerAllData() sel: 0 raw ADC, 1 processed
+#define replay_channel_num 32	// channels of a sel, history and status channels
+#define replay_wait_ms 2000	// longest wait for a history upload
+
+enum {	// record types
+	rec_frame = 1,	// TriggerAllDataReached() returned
+	rec_stamp,	// GetTimestampData(1), the frame stamp
+	rec_trigger,	// GetTriggerAllData(item, channel)
+	rec_history_ready,	// HistoryChannelDataReached() returned
+	rec_history,	// GetHistoryChannelData(channel)
+	rec_status	// a status getter returned a new value
+};
+
+enum {	// status items
+	st_rf_amp, st_rf_phase, st_di, st_led0, st_led1, st_storage_ready, st_clock,
+	st_vc, st_phase, st_xy, st_vc_sum, st_xy_protect, st_sum_protect, st_wr,
+	st_item_num
+};
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t recordSize;	// sizeof(replayRecord_t)
+	uint32_t reserved;
+}replayHeader_t;
+
+typedef struct {
+	uint16_t type;
+	uint16_t item;	// sel of rec_trigger, status item of rec_status
+	uint32_t channel;
+	uint32_t length;	// float samples after the record
+	uint32_t reserved;
+	int64_t time;	// ns since the start of the recording
+	int64_t wrSec;	// rec_stamp
+	int32_t wrTick;
+	int32_t reserved2;
+	double value;	// rec_status
+}replayRecord_t;
+
+static int mode=replay_mode_hardware;
+static char filePath[256];
+static double replaySpeed=1;	// 0 as fast as possible
+static int replayLoop=0;
+static unsigned int recordFrames=0;	// 0 no limit
+static unsigned int trigLength=0, adcLength=0, histLength=0;	// samples the driver reads
+
+/* Everything below is under replayLock: the file while recording, the
+   replayed samples and values. */
+static pthread_mutex_t replayLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t historyCond = PTHREAD_COND_INITIALIZER;
+static FILE *fp=NULL;
+static int state=replay_state_idle;
+static unsigned int frames=0;	// played or recorded
+static unsigned int passes=0;
+static float *trigData[replay_sel_num][replay_channel_num];
+static float *histData[replay_channel_num];
+static unsigned int histUploads=0;	// history uploads applied
+static unsigned int histChanUpload[replay_channel_num];	// upload of histData[ch]
+static unsigned int histWant=0;	// upload HistoryChannelDataReached() waited for
+static struct timespec histDeadline;	// of the channels of histWant
+static double status[st_item_num][replay_channel_num];
+static long long frameSec=0;
+static int frameTick=0;
+static double recStatus[st_item_num][replay_channel_num];
+static unsigned char recStatusValid[st_item_num][replay_channel_num];
+static struct timespec recordStart;
+
+/* Replay cursor, pthread() only. */
+static replayRecord_t next;
+static int haveNext=0;
+static int64_t paceOrigin=-1;	// recording time at paceStart
+static struct timespec paceStart;
+static unsigned int passFrames=0;
+
+/* iocsh BPMReplay, before iocInit. An empty path runs on the hardware. */
+void ReplayConfig(const char *path, double speed, int loop)
+{
+	if(path == NULL || path[0] == '\0')
+	{
+		mode = replay_mode_hardware;
+		return;
+	}
+	snprintf(filePath, sizeof(filePath), "%s", path);
+	replaySpeed = (speed > 0) ? speed : 0;
+	replayLoop = loop;
+	mode = replay_mode_replay;
+}
+
+/* iocsh BPMRecord, before iocInit. Stops after frames frames, 0 never. */
+void RecordConfig(const char *path, unsigned int maxFrames)
+{
+	if(path == NULL || path[0] == '\0')
+	{
+		mode = replay_mode_hardware;
+		return;
+	}
+	snprintf(filePath, sizeof(filePath), "%s", path);
+	recordFrames = maxFrames;
+	mode = replay_mode_record;
+}
+
+int ReplayMode(void)
+{
+	return mode;
+}
+
+int ReplayFast(void)
+{
+	return mode == replay_mode_replay && replaySpeed <= 0;
+}
+
+/* Called by InitDevice() before the entry points are bound, with the samples
+   per channel the driver reads. A recording that can't be opened is an error
+   when replaying; when recording the driver runs on the hardware only. */
+int ReplayOpen(unsigned int trigLen, unsigned int adcLen, unsigned int histLen)
+{
+	replayHeader_t header;
+	trigLength = trigLen;
+	adcLength = adcLen;
+	histLength = histLen;
+	if(mode == replay_mode_replay)
+	{
+		fp = fopen(filePath, "rb");
+		if(fp == NULL || fread(&header, sizeof(header), 1, fp) != 1 || header.magic != replay_magic
+			|| header.version != replay_version || header.recordSize != sizeof(replayRecord_t))
+		{
+			DrvLog(DRVLOG_ERROR, "Can't replay %s, not a recording of version %d.\n", filePath, replay_version);
+			if(fp != NULL)
+				fclose(fp);
+			fp = NULL;
+			return -1;
+		}
+		state = replay_state_running;
+		if(replaySpeed > 0)
+			DrvLog(DRVLOG_INFO, "Replaying %s at %g times the recorded pace%s.\n", filePath, replaySpeed, replayLoop ? ", looping" : "");
+		else
+			DrvLog(DRVLOG_INFO, "Replaying %s as fast as possible%s.\n", filePath, replayLoop ? ", looping" : "");
+		return 0;
+	}
+	if(mode == replay_mode_record)
+	{
+		memset(&header, 0, sizeof(header));
+		header.magic = replay_magic;
+		header.version = replay_version;
+		header.recordSize = sizeof(replayRecord_t);
+		fp = fopen(filePath, "wb");
+		if(fp == NULL || fwrite(&header, sizeof(header), 1, fp) != 1)
+		{
+			DrvLog(DRVLOG_ERROR, "Can't record to %s, running on the hardware only.\n", filePath);
+			if(fp != NULL)
+				fclose(fp);
+			fp = NULL;
+			mode = replay_mode_hardware;
+			return 0;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &recordStart);
+		state = replay_state_running;
+		DrvLog(DRVLOG_INFO, "Recording the hardware to %s.\n", filePath);
+	}
+	return 0;
+}
+
+void ReplayStats(unsigned int *framesDone, int *stateNow)
+{
+	pthread_mutex_lock(&replayLock);
+	*framesDone = frames;
+	*stateNow = state;
+	pthread_mutex_unlock(&replayLock);
+}
+
+void ReplayReport(void)
+{
+	static const char *stateNames[] = {"idle", "running", "finished"};
+	if(mode == replay_mode_hardware)
+		return;
+	pthread_mutex_lock(&replayLock);
+	if(mode == replay_mode_replay)
+		printf("  replaying %s, %s, %u frames in %u passes\n", filePath, stateNames[state], frames, passes + 1);
+	else
+		printf("  recording to %s, %s, %u frames\n", filePath, stateNames[state], frames);
+	pthread_mutex_unlock(&replayLock);
+}
+
+/*------------------------------- replay -------------------------------*/
+
+static int ReadSamples(float *buf, unsigned int cap, unsigned int length)
+{
+	unsigned int n = (length < cap) ? length : cap;
+	if(fread(buf, sizeof(float), n, fp) != n)
+		return -1;
+	if(n < cap)
+		memset(buf + n, 0, (cap - n) * sizeof(float));
+	if(length > n && fseek(fp, (long)(length - n) * sizeof(float), SEEK_CUR) != 0)
+		return -1;
+	return 0;
+}
+
+/* Waits until the recorded time of a record, relative to the first record
+   played in this pass. */
+static void Pace(int64_t time)
+{
+	struct timespec at;
+	int64_t ns;
+	if(replaySpeed <= 0)
+		return;
+	if(paceOrigin < 0)
+	{
+		paceOrigin = time;
+		clock_gettime(CLOCK_MONOTONIC, &paceStart);
+		return;
+	}
+	ns = (int64_t)((time - paceOrigin) / replaySpeed);
+	if(ns <= 0)
+		return;
+	at.tv_sec = paceStart.tv_sec + ns / 1000000000;
+	at.tv_nsec = paceStart.tv_nsec + ns % 1000000000;
+	if(at.tv_nsec >= 1000000000)
+	{
+		at.tv_sec++;
+		at.tv_nsec -= 1000000000;
+	}
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR)
+		;
+}
+
+/* The samples are read under replayLock, so no reader sees half a channel. */
+static int Apply(const replayRecord_t *rec)
+{
+	float **slot = NULL;
+	unsigned int cap = 0;
+	int ret = 0;
+	pthread_mutex_lock(&replayLock);
+	switch(rec->type)
+	{
+		case rec_frame:
+			frames++;
+			passFrames++;
+			break;
+		case rec_stamp:
+			frameSec = rec->wrSec;
+			frameTick = rec->wrTick;
+			break;
+		case rec_trigger:
+			if(rec->item < replay_sel_num && rec->channel < replay_channel_num)
+			{
+				slot = &trigData[rec->item][rec->channel];
+				cap = (rec->item == 0) ? adcLength : trigLength;
+			}
+			break;
+		case rec_history_ready:
+			histUploads++;
+			pthread_cond_broadcast(&historyCond);
+			break;
+		case rec_history:
+			if(rec->channel < replay_channel_num)
+			{
+				slot = &histData[rec->channel];
+				cap = histLength;
+			}
+			break;
+		case rec_status:
+			if(rec->item < st_item_num && rec->channel < replay_channel_num)
+				status[rec->item][rec->channel] = rec->value;
+			break;
+	}
+	if(slot != NULL && *slot == NULL)
+		*slot = malloc(cap * sizeof(float));
+	if(slot != NULL && *slot != NULL)
+	{
+		ret = ReadSamples(*slot, cap, rec->length);
+		if(rec->type == rec_history)
+		{
+			histChanUpload[rec->channel] = histUploads;
+			pthread_cond_broadcast(&historyCond);
+		}
+	}
+	else if(rec->length > 0)
+		ret = fseek(fp, (long)rec->length * sizeof(float), SEEK_CUR);
+	pthread_mutex_unlock(&replayLock);
+	return ret;
+}
+
+/* End of the recording: start over when looping and the pass had frames,
+   else stop like a hardware that no longer triggers. */
+static int Rewind(void)
+{
+	if(!replayLoop || passFrames == 0 || fseek(fp, sizeof(replayHeader_t), SEEK_SET) != 0)
+		return -1;
+	pthread_mutex_lock(&replayLock);
+	passes++;
+	pthread_mutex_unlock(&replayLock);
+	passFrames = 0;
+	paceOrigin = -1;
+	return 0;
+}
+
+static void Finish(void)
+{
+	pthread_mutex_lock(&replayLock);
+	state = replay_state_finished;
+	pthread_cond_broadcast(&historyCond);
+	pthread_mutex_unlock(&replayLock);
+	DrvLog(DRVLOG_INFO, "Replay of %s finished after %u frames.\n", filePath, frames);
+	while(1)
+		sleep(60);
+}
+
+static int ReplayTriggerAllDataReached(void)
+{
+	int started = 0;
+	while(1)
+	{
+		if(!haveNext)
+		{
+			if(fread(&next, sizeof(next), 1, fp) != 1)
+			{
+				if(started)
+					return 1;
+				if(Rewind() == 0)
+					continue;
+				Finish();
+			}
+			haveNext = 1;
+		}
+		if(next.type == rec_frame && started)
+			return 1;
+		Pace(next.time);
+		haveNext = 0;
+		if(Apply(&next) != 0)
+			DrvLog(DRVLOG_WARN, "Replay of %s: record truncated.\n", filePath);
+		if(next.type == rec_frame)
+			started = 1;
+	}
+}
+
+static void ReplayGetTriggerAllData(int sel, int channel, float *data)
+{
+	unsigned int length = (sel == 0) ? adcLength : trigLength;
+	pthread_mutex_lock(&replayLock);
+	if(sel >= 0 && sel < replay_sel_num && channel >= 0 && channel < replay_channel_num
+		&& trigData[sel][channel] != NULL)
+		memcpy(data, trigData[sel][channel], length * sizeof(float));
+	else
+		memset(data, 0, length * sizeof(float));
+	pthread_mutex_unlock(&replayLock);
+}
+
+static void ReplayGetTimestampData(int ch, long long *tm_utc, int *pps)
+{
+	pthread_mutex_lock(&replayLock);
+	*tm_utc = frameSec;
+	*pps = frameTick;
+	pthread_mutex_unlock(&replayLock);
+}
+
+static void WaitDeadline(struct timespec *deadline)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += replay_wait_ms / 1000;
+	deadline->tv_nsec += (replay_wait_ms % 1000) * 1000000;
+	if(deadline->tv_nsec >= 1000000000)
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/* One deadline covers an upload and its channels, a channel that is not in
+   the recording stalls its reader once, not once per channel. */
+static int ReplayHistoryChannelDataReached(void)
+{
+	unsigned int want;
+	pthread_mutex_lock(&replayLock);
+	WaitDeadline(&histDeadline);
+	want = histUploads + 1;
+	while(histUploads < want && state == replay_state_running)
+	{
+		if(pthread_cond_timedwait(&historyCond, &replayLock, &histDeadline) == ETIMEDOUT)
+			break;
+	}
+	if(histUploads < want)
+		DrvLog(DRVLOG_WARN, "Replay of %s: no history upload, the last one is used.\n", filePath);
+	histWant = histUploads;
+	pthread_mutex_unlock(&replayLock);
+	return 1;
+}
+
+static void ReplayGetHistoryChannelData(int channel, float *data)
+{
+	pthread_mutex_lock(&replayLock);
+	if(channel >= 0 && channel < replay_channel_num)
+	{
+		while(histChanUpload[channel] < histWant && state == replay_state_running)
+		{
+			if(pthread_cond_timedwait(&historyCond, &replayLock, &histDeadline) == ETIMEDOUT)
+				break;
+		}
+	}
+	if(channel >= 0 && channel < replay_channel_num && histData[channel] != NULL)
+		memcpy(data, histData[channel], histLength * sizeof(float));
+	else
+		memset(data, 0, histLength * sizeof(float));
+	pthread_mutex_unlock(&replayLock);
+}
+
+static double Status(int item, int channel)
+{
+	double value = 0;
+	if(channel < 0 || channel >= replay_channel_num)
+		return 0;
+	pthread_mutex_lock(&replayLock);
+	value = status[item][channel];
+	pthread_mutex_unlock(&replayLock);
+	return value;
+}
+
+static void ReplayGetRfInfo(int channel, float *amp, float *phase)
+{
+	*amp = Status(st_rf_amp, channel);
+	*phase = Status(st_rf_phase, channel);
+}
+
+static void ReplayGetDI(int channel, int *value)
+{
+	*value = Status(st_di, channel);
+}
+
+static int ReplayGetLed0(void) { return Status(st_led0, 0); }
+static int ReplayGetLed1(void) { return Status(st_led1, 0); }
+static int ReplayGetStorageReady(void) { return Status(st_storage_ready, 0); }
+static int ReplayGetClock(void) { return Status(st_clock, 0); }
+static int ReplayGetVc(int channel) { return Status(st_vc, channel); }
+static float ReplayGetPhase(int channel) { return Status(st_phase, channel); }
+static int ReplayGetXY(int channel) { return Status(st_xy, channel); }
+static int ReplayGetVcSum(int channel) { return Status(st_vc_sum, channel); }
+static int ReplayGetXYProtect(int channel) { return Status(st_xy_protect, channel); }
+static int ReplayGetSumProtect(int channel) { return Status(st_sum_protect, channel); }
+static int ReplayGetWR(int channel) { return Status(st_wr, channel); }
+
+static int ReplaySystemInit(void) { return 0; }
+static void ReplayNop(void) { }
+static void ReplayNopInt(int value) { }
+static void ReplayNopFloat(float value) { }
+static void ReplayNopIntInt(int channel, int value) { }
+static void ReplayNopIntFloat(int channel, float value) { }
+
+/*------------------------------- record -------------------------------*/
+
+static int (*realTriggerAllDataReached)(void);
+static void (*realGetTriggerAllData)(int sel, int channel, float *data);
+static void (*realGetTimestampData)(int ch, long long *tm_utc, int *pps);
+static int (*realHistoryChannelDataReached)(void);
+static void (*realGetHistoryChannelData)(int channel, float *data);
+static void (*realGetRfInfo)(int channel, float *amp, float *phase);
+static void (*realGetDI)(int channel, int *value);
+static int (*realGetLed0)(void);
+static int (*realGetLed1)(void);
+static int (*realGetStorageReady)(void);
+static int (*realGetClock)(void);
+static int (*realGetVc)(int channel);
+static float (*realGetPhase)(int channel);
+static int (*realGetXY)(int channel);
+static int (*realGetVcSum)(int channel);
+static int (*realGetXYProtect)(int channel);
+static int (*realGetSumProtect)(int channel);
+static int (*realGetWR)(int channel);
+
+/* Called with replayLock held. */
+static void StopRecording(void)
+{
+	fclose(fp);
+	fp = NULL;
+	state = replay_state_finished;
+	DrvLog(DRVLOG_INFO, "Recorded %u frames to %s.\n", frames, filePath);
+}
+
+/* Called with replayLock held. Recording stops at the first write error. */
+static void Append(replayRecord_t *rec, const float *data)
+{
+	struct timespec now;
+	if(state != replay_state_running)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	rec->time = (now.tv_sec - recordStart.tv_sec) * 1000000000LL + (now.tv_nsec - recordStart.tv_nsec);
+	if(fwrite(rec, sizeof(*rec), 1, fp) != 1
+		|| (rec->length > 0 && fwrite(data, sizeof(float), rec->length, fp) != rec->length))
+	{
+		DrvLog(DRVLOG_ERROR, "Recording to %s failed.\n", filePath);
+		StopRecording();
+	}
+}
+
+static void RecordEvent(int type, int item, int channel, unsigned int length, const float *data)
+{
+	replayRecord_t rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.type = type;
+	rec.item = item;
+	rec.channel = channel;
+	rec.length = length;
+	pthread_mutex_lock(&replayLock);
+	Append(&rec, data);
+	pthread_mutex_unlock(&replayLock);
+}
+
+static void RecordStatus(int item, int channel, double value)
+{
+	replayRecord_t rec;
+	if(channel < 0 || channel >= replay_channel_num)
+		return;
+	pthread_mutex_lock(&replayLock);
+	if(!recStatusValid[item][channel] || recStatus[item][channel] != value)
+	{
+		recStatusValid[item][channel] = 1;
+		recStatus[item][channel] = value;
+		memset(&rec, 0, sizeof(rec));
+		rec.type = rec_status;
+		rec.item = item;
+		rec.channel = channel;
+		rec.value = value;
+		Append(&rec, NULL);
+	}
+	pthread_mutex_unlock(&replayLock);
+}
+
+static int RecordTriggerAllDataReached(void)
+{
+	replayRecord_t rec;
+	int ret = realTriggerAllDataReached();
+	memset(&rec, 0, sizeof(rec));
+	rec.type = rec_frame;
+	pthread_mutex_lock(&replayLock);
+	if(state == replay_state_running)
+	{
+		if(recordFrames > 0 && frames >= recordFrames)
+			StopRecording();
+		else
+		{
+			Append(&rec, NULL);
+			frames++;
+		}
+	}
+	pthread_mutex_unlock(&replayLock);
+	return ret;
+}
+
+static void RecordGetTriggerAllData(int sel, int channel, float *data)
+{
+	realGetTriggerAllData(sel, channel, data);
+	RecordEvent(rec_trigger, sel, channel, (sel == 0) ? adcLength : trigLength, data);
+}
+
+static void RecordGetTimestampData(int ch, long long *tm_utc, int *pps)
+{
+	replayRecord_t rec;
+	realGetTimestampData(ch, tm_utc, pps);
+	if(ch != 1)
+		return;
+	memset(&rec, 0, sizeof(rec));
+	rec.type = rec_stamp;
+	rec.wrSec = *tm_utc;
+	rec.wrTick = *pps;
+	pthread_mutex_lock(&replayLock);
+	Append(&rec, NULL);
+	pthread_mutex_unlock(&replayLock);
+}
+
+static int RecordHistoryChannelDataReached(void)
+{
+	int ret = realHistoryChannelDataReached();
+	RecordEvent(rec_history_ready, 0, 0, 0, NULL);
+	return ret;
+}
+
+static void RecordGetHistoryChannelData(int channel, float *data)
+{
+	realGetHistoryChannelData(channel, data);
+	RecordEvent(rec_history, 0, channel, histLength, data);
+}
+
+static void RecordGetRfInfo(int channel, float *amp, float *phase)
+{
+	realGetRfInfo(channel, amp, phase);
+	RecordStatus(st_rf_amp, channel, *amp);
+	RecordStatus(st_rf_phase, channel, *phase);
+}
+
+static void RecordGetDI(int channel, int *value)
+{
+	realGetDI(channel, value);
+	RecordStatus(st_di, channel, *value);
+}
+
+static int RecordGetLed0(void) { int v = realGetLed0(); RecordStatus(st_led0, 0, v); return v; }
+static int RecordGetLed1(void) { int v = realGetLed1(); RecordStatus(st_led1, 0, v); return v; }
+static int RecordGetStorageReady(void) { int v = realGetStorageReady(); RecordStatus(st_storage_ready, 0, v); return v; }
+static int RecordGetClock(void) { int v = realGetClock(); RecordStatus(st_clock, 0, v); return v; }
+static int RecordGetVc(int channel) { int v = realGetVc(channel); RecordStatus(st_vc, channel, v); return v; }
+static float RecordGetPhase(int channel) { float v = realGetPhase(channel); RecordStatus(st_phase, channel, v); return v; }
+static int RecordGetXY(int channel) { int v = realGetXY(channel); RecordStatus(st_xy, channel, v); return v; }
+static int RecordGetVcSum(int channel) { int v = realGetVcSum(channel); RecordStatus(st_vc_sum, channel, v); return v; }
+static int RecordGetXYProtect(int channel) { int v = realGetXYProtect(channel); RecordStatus(st_xy_protect, channel, v); return v; }
+static int RecordGetSumProtect(int channel) { int v = realGetSumProtect(channel); RecordStatus(st_sum_protect, channel, v); return v; }
+static int RecordGetWR(int channel) { int v = realGetWR(channel); RecordStatus(st_wr, channel, v); return v; }
+
+/*------------------------------ binding -------------------------------*/
+
+typedef struct {
+	const char *name;
+	void *replay;	// stand-in when replaying
+	void *record;	// wrapper when recording, NULL calls the library directly
+	void **real;	// library function called by the wrapper
+}replaySymbol_t;
+
+static const replaySymbol_t symbols[] = {
+	{"SystemInit", ReplaySystemInit, NULL, NULL},
+	{"TriggerAllDataReached", ReplayTriggerAllDataReached, RecordTriggerAllDataReached, (void **)&realTriggerAllDataReached},
+	{"GetTriggerAllData", ReplayGetTriggerAllData, RecordGetTriggerAllData, (void **)&realGetTriggerAllData},
+	{"GetTimestampData", ReplayGetTimestampData, RecordGetTimestampData, (void **)&realGetTimestampData},
+	{"HistoryChannelDataReached", ReplayHistoryChannelDataReached, RecordHistoryChannelDataReached, (void **)&realHistoryChannelDataReached},
+	{"GetHistoryChannelData", ReplayGetHistoryChannelData, RecordGetHistoryChannelData, (void **)&realGetHistoryChannelData},
+	{"GetRfInfo", ReplayGetRfInfo, RecordGetRfInfo, (void **)&realGetRfInfo},
+	{"GetDI", ReplayGetDI, RecordGetDI, (void **)&realGetDI},
+	{"GetFPGA_LED0", ReplayGetLed0, RecordGetLed0, (void **)&realGetLed0},
+	{"GetFPGA_LED1", ReplayGetLed1, RecordGetLed1, (void **)&realGetLed1},
+	{"GetStorageDataReady", ReplayGetStorageReady, RecordGetStorageReady, (void **)&realGetStorageReady},
+	{"GetPlBrokenState", ReplayGetClock, RecordGetClock, (void **)&realGetClock},
+	{"GetVcValue", ReplayGetVc, RecordGetVc, (void **)&realGetVc},
+	{"GetBPMPhaseValue", ReplayGetPhase, RecordGetPhase, (void **)&realGetPhase},
+	{"GetxyPosition", ReplayGetXY, RecordGetXY, (void **)&realGetXY},
+	{"GetVcSumValue", ReplayGetVcSum, RecordGetVcSum, (void **)&realGetVcSum},
+	{"GetxyProtect", ReplayGetXYProtect, RecordGetXYProtect, (void **)&realGetXYProtect},
+	{"GetSumProtect", ReplayGetSumProtect, RecordGetSumProtect, (void **)&realGetSumProtect},
+	{"GetWRStatus", ReplayGetWR, RecordGetWR, (void **)&realGetWR},
+	{"SetDO", ReplayNopIntInt, NULL, NULL},
+	{"SetArmLedEnable", ReplayNopInt, NULL, NULL},
+	{"SetFanLedStatus", ReplayNopInt, NULL, NULL},
+	{"SetOutputPulseEnable", ReplayNopInt, NULL, NULL},
+	{"SetInnerTrigEn", ReplayNopInt, NULL, NULL},
+	{"SetHistoryTrigger", ReplayNopInt, NULL, NULL},
+	{"SetRsetDataStorage", ReplayNopInt, NULL, NULL},
+	{"SetTriggerExtractDataRatio", ReplayNopFloat, NULL, NULL},
+	{"SetHistoryExtractDataRatio", ReplayNopFloat, NULL, NULL},
+	{"SetChangeStartIQSig", ReplayNopInt, NULL, NULL},
+	{"SetBPMk1", ReplayNopIntFloat, NULL, NULL},
+	{"SetBPMk2", ReplayNopIntFloat, NULL, NULL},
+	{"SetBPMk3", ReplayNopIntFloat, NULL, NULL},
+	{"SetBPMPhaseOffset", ReplayNopIntFloat, NULL, NULL},
+	{"SetBPMkxy", ReplayNopIntInt, NULL, NULL},
+	{"SetBPMxyOffset", ReplayNopIntInt, NULL, NULL},
+	{"SetBPMxyLimits", ReplayNopIntInt, NULL, NULL},
+	{"SetReset", ReplayNopInt, NULL, NULL},
+	{"SetBPMSumLimits", ReplayNopIntInt, NULL, NULL},
+	{"SetBPMProtectFilterTime", ReplayNopFloat, NULL, NULL},
+	{"SetWRCaputureDataTrigger", ReplayNop, NULL, NULL},
+	{"SetFreqControlWordtoDDS", ReplayNopInt, NULL, NULL},
+	{"SetSelectExternelTrigger", ReplayNopInt, NULL, NULL}
+};
+#define replay_symbol_num (sizeof(symbols)/sizeof(symbols[0]))
+
+/* The function InitDevice() binds for a liblowlevel entry point; real is the
+   library function, NULL when replaying. */
+void *ReplaySymbol(const char *name, void *real)
+{
+	unsigned int i;
+	if(mode == replay_mode_hardware)
+		return real;
+	for(i=0; i<replay_symbol_num; i++)
+	{
+		if(strcmp(symbols[i].name, name) != 0)
+			continue;
+		if(mode == replay_mode_replay)
+			return symbols[i].replay;
+		if(symbols[i].record == NULL || real == NULL)
+			return real;
+		*symbols[i].real = real;
+		return symbols[i].record;
+	}
+	if(mode == replay_mode_replay)
+		DrvLog(DRVLOG_ERROR, "No replay stand-in for %s.\n", name);
+	return real;
+}
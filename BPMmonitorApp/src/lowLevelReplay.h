@@ -0,0 +1,33 @@
+/* lowLevelReplay.h */
+/* Author:  Gao    Create Date:  19Oct2026 */
+/* The last modified date:  19Oct2026 */
+
+#ifndef _lowLevelReplay_H
+#define _lowLevelReplay_H
+
+#define replay_mode_hardware 0
+#define replay_mode_replay 1
+#define replay_mode_record 2
+
+#define replay_state_idle 0
+#define replay_state_running 1
+#define replay_state_finished 2
+
+/* The following functions will be called from driver layer.**************/
+void ReplayConfig(const char *path, double speed, int loop);
+
+void RecordConfig(const char *path, unsigned int frames);
+
+int ReplayMode(void);
+
+int ReplayOpen(unsigned int trigLen, unsigned int adcLen, unsigned int histLen);
+
+void *ReplaySymbol(const char *name, void *real);
+
+int ReplayFast(void);
+
+void ReplayStats(unsigned int *frames, int *state);
+
+void ReplayReport(void);
+
+#endif
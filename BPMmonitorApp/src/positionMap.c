@@ -0,0 +1,406 @@
+/* positionMap.c */
+/* Nonlinear position correction of the two BPMs (bench wire-scan maps) */
+/* Author:  Gao    Create Date:  19Oct2026 */
+/* The last modified date:  19Oct2026 */
+
+/* A map turns the linear X/Y reading of a BPM (k*delta/sum+offset, in mm)
+   into the true position in mm. It is either a 2D polynomial or a regular
+   grid interpolated bilinearly. A map file is CSV:
+
+     poly, ORDER                       grid, NX, NY, XMIN, XMAX, YMIN, YMAX
+     i, j, cx, cy    (one per term)    x, y    (NX*NY rows, X varies fastest)
+
+   a polynomial gives x' = sum cx*x^i*y^j and y' = sum cy*x^i*y^j, a grid
+   gives the true x/y at each reading node. Lines starting with # are
+   comments. A parsed map is published by swapping one pointer under mapLock
+   and never modified; PosMapApply() holds the lock while it runs, which only
+   a load or a switch waits on. */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "positionMap.h"
+#include "driverLog.h"
+
+#define map_line_len 256
+#define map_max_order 7
+#define map_max_nodes 65536
+
+typedef struct {
+	int type;
+	/* POSMAP_POLY */
+	int order;
+	int terms;
+	int pi[(map_max_order+1)*(map_max_order+2)/2];
+	int pj[(map_max_order+1)*(map_max_order+2)/2];
+	float cx[(map_max_order+1)*(map_max_order+2)/2];
+	float cy[(map_max_order+1)*(map_max_order+2)/2];
+	/* POSMAP_GRID */
+	int nx;
+	int ny;
+	float x0;
+	float y0;
+	float invDx;	// nodes per mm
+	float invDy;
+	float *gx;	// ny*nx, X varies fastest
+	float *gy;
+}posMap_t;
+
+static pthread_mutex_t mapLock = PTHREAD_MUTEX_INITIALIZER;
+static posMap_t *maps[pos_map_bpm_num];
+static int mapEnable[pos_map_bpm_num];
+
+static posMap_t *ParseMapFile(const char *path, char *err, size_t errLen);
+static int ParseFields(char *line, double *values, int maxValues);
+static void PublishMap(int bpm, posMap_t *map);
+static void FreeMap(posMap_t *map);
+static void ApplyPoly(const posMap_t *map, float *x, float *y, int length);
+static void ApplyGrid(const posMap_t *map, float *x, float *y, int length);
+
+/* Parse and publish a map, the map in use is kept if the file is bad.
+   The on/off switch of the BPM is not changed. */
+int PosMapLoad(int bpm, const char *path)
+{
+	posMap_t *map;
+	char err[128];
+
+	if(bpm < 0 || bpm >= pos_map_bpm_num)
+		return -1;
+	map = ParseMapFile(path, err, sizeof(err));
+	if(map == NULL)
+	{
+		DrvLog(DRVLOG_ERROR, "Position map: %s not loaded for BPM%d, %s.\n", path, bpm+1, err);
+		return -1;
+	}
+	PublishMap(bpm, map);
+	if(map->type == POSMAP_POLY)
+		DrvLog(DRVLOG_INFO, "Position map: loaded %s for BPM%d, polynomial order %d, %d terms\n", path, bpm+1, map->order, map->terms);
+	else
+		DrvLog(DRVLOG_INFO, "Position map: loaded %s for BPM%d, grid %d x %d\n", path, bpm+1, map->nx, map->ny);
+	return 0;
+}
+
+void PosMapClear(int bpm)
+{
+	if(bpm < 0 || bpm >= pos_map_bpm_num)
+		return;
+	PublishMap(bpm, NULL);
+}
+
+void PosMapEnable(int bpm, int enable)
+{
+	if(bpm < 0 || bpm >= pos_map_bpm_num)
+		return;
+	pthread_mutex_lock(&mapLock);
+	mapEnable[bpm] = (enable != 0);
+	pthread_mutex_unlock(&mapLock);
+}
+
+int PosMapType(int bpm)
+{
+	int type = POSMAP_NONE;
+	if(bpm < 0 || bpm >= pos_map_bpm_num)
+		return type;
+	pthread_mutex_lock(&mapLock);
+	if(maps[bpm] != NULL)
+		type = maps[bpm]->type;
+	pthread_mutex_unlock(&mapLock);
+	return type;
+}
+
+/* 1 if a map is loaded and switched on. */
+int PosMapEnabled(int bpm)
+{
+	int enabled;
+	if(bpm < 0 || bpm >= pos_map_bpm_num)
+		return 0;
+	pthread_mutex_lock(&mapLock);
+	enabled = (maps[bpm] != NULL && mapEnable[bpm]);
+	pthread_mutex_unlock(&mapLock);
+	return enabled;
+}
+
+/* Correct x/y (um) of one BPM in place. Returns 1 if a map was applied. */
+int PosMapApply(int bpm, float *x, float *y, int length)
+{
+	const posMap_t *map;
+	int applied = 0;
+	if(bpm < 0 || bpm >= pos_map_bpm_num)
+		return 0;
+	pthread_mutex_lock(&mapLock);
+	map = maps[bpm];
+	if(map != NULL && mapEnable[bpm])
+	{
+		if(map->type == POSMAP_POLY)
+			ApplyPoly(map, x, y, length);
+		else
+			ApplyGrid(map, x, y, length);
+		applied = 1;
+	}
+	pthread_mutex_unlock(&mapLock);
+	return applied;
+}
+
+/* x' and y' share the monomials, which are built once per sample. */
+static void ApplyPoly(const posMap_t *map, float *x, float *y, int length)
+{
+	float cx[sizeof(map->cx)/sizeof(map->cx[0])], cy[sizeof(map->cy)/sizeof(map->cy[0])];
+	int pi[sizeof(map->pi)/sizeof(map->pi[0])], pj[sizeof(map->pj)/sizeof(map->pj[0])];
+	float xp[map_max_order+1], yp[map_max_order+1];
+	float sx, sy, m;
+	const int order = map->order, terms = map->terms;
+	int n, i;
+	memcpy(cx, map->cx, sizeof(cx));
+	memcpy(cy, map->cy, sizeof(cy));
+	memcpy(pi, map->pi, sizeof(pi));
+	memcpy(pj, map->pj, sizeof(pj));
+	xp[0] = 1;
+	yp[0] = 1;
+	for(n=0; n<length; n++)
+	{
+		for(i=1; i<=order; i++)
+		{
+			xp[i] = xp[i-1] * x[n] * 0.001f;
+			yp[i] = yp[i-1] * y[n] * 0.001f;
+		}
+		sx = 0;
+		sy = 0;
+		for(i=0; i<terms; i++)
+		{
+			m = xp[pi[i]] * yp[pj[i]];
+			sx += cx[i] * m;
+			sy += cy[i] * m;
+		}
+		x[n] = sx * 1000;
+		y[n] = sy * 1000;
+	}
+}
+
+/* Readings outside the grid take the edge cell. Everything the loop needs is
+   copied to locals first (the stores to x/y could alias the map otherwise) and
+   the cell index is clamped with selects, so the loop stays straight-line. */
+static void ApplyGrid(const posMap_t *map, float *x, float *y, int length)
+{
+	const float *gx = map->gx, *gy = map->gy;
+	const int nx = map->nx, ixMax = map->nx - 2, iyMax = map->ny - 2;
+	const float sx = map->invDx * 0.001f, sy = map->invDy * 0.001f;	// um to nodes
+	const float ox = map->x0 * map->invDx, oy = map->y0 * map->invDy;
+	const float fxMax = map->nx - 1, fyMax = map->ny - 1;
+	float fx, fy, tx, ty, w00, w10, w01, w11;
+	int n, ix, iy, k;
+	for(n=0; n<length; n++)
+	{
+		fx = x[n] * sx - ox;
+		fy = y[n] * sy - oy;
+		fx = (fx < 0) ? 0 : fx;
+		fy = (fy < 0) ? 0 : fy;
+		fx = (fx > fxMax) ? fxMax : fx;
+		fy = (fy > fyMax) ? fyMax : fy;
+		ix = (int)fx;
+		iy = (int)fy;
+		ix = (ix > ixMax) ? ixMax : ix;
+		iy = (iy > iyMax) ? iyMax : iy;
+		tx = fx - ix;
+		ty = fy - iy;
+		w00 = (1 - tx) * (1 - ty);
+		w10 = tx * (1 - ty);
+		w01 = (1 - tx) * ty;
+		w11 = tx * ty;
+		k = iy * nx + ix;
+		x[n] = (w00*gx[k] + w10*gx[k+1] + w01*gx[k+nx] + w11*gx[k+nx+1]) * 1000;
+		y[n] = (w00*gy[k] + w10*gy[k+1] + w01*gy[k+nx] + w11*gy[k+nx+1]) * 1000;
+	}
+}
+
+static posMap_t *ParseMapFile(const char *path, char *err, size_t errLen)
+{
+	FILE *fp;
+	char line[map_line_len];
+	char *p;
+	double v[8];
+	int lineNo = 0, rows = 0, expected = 0, n;
+	posMap_t *map = NULL;
+
+	fp = fopen(path, "r");
+	if(fp == NULL)
+	{
+		snprintf(err, errLen, "%s", strerror(errno));
+		return NULL;
+	}
+	while(fgets(line, sizeof(line), fp) != NULL)
+	{
+		lineNo++;
+		if(strchr(line, '\n') == NULL && !feof(fp))
+		{
+			snprintf(err, errLen, "line %d is too long", lineNo);
+			goto fail;
+		}
+		line[strcspn(line, "\r\n")] = '\0';
+		p = line + strspn(line, " \t");
+		if(*p == '\0' || *p == '#')
+			continue;
+		if(map == NULL)
+		{
+			map = calloc(1, sizeof(posMap_t));
+			if(map == NULL)
+			{
+				snprintf(err, errLen, "out of memory");
+				goto fail;
+			}
+			if(strncmp(p, "poly", 4) == 0 && ParseFields(p + 4, v, 1) == 1)
+			{
+				map->type = POSMAP_POLY;
+				map->order = (int)v[0];
+				if(v[0] != map->order || map->order < 1 || map->order > map_max_order)
+				{
+					snprintf(err, errLen, "polynomial order must be 1 to %d", map_max_order);
+					goto fail;
+				}
+				expected = (map->order+1)*(map->order+2)/2;
+			}
+			else if(strncmp(p, "grid", 4) == 0 && ParseFields(p + 4, v, 6) == 6)
+			{
+				map->type = POSMAP_GRID;
+				map->nx = (int)v[0];
+				map->ny = (int)v[1];
+				if(v[0] != map->nx || v[1] != map->ny || map->nx < 2 || map->ny < 2
+					|| map->nx * map->ny > map_max_nodes || !(v[3] > v[2]) || !(v[5] > v[4]))
+				{
+					snprintf(err, errLen, "bad grid header, need NX NY >= 2 and MIN < MAX");
+					goto fail;
+				}
+				map->x0 = v[2];
+				map->y0 = v[4];
+				map->invDx = (map->nx - 1) / (v[3] - v[2]);
+				map->invDy = (map->ny - 1) / (v[5] - v[4]);
+				expected = map->nx * map->ny;
+				map->gx = malloc(expected * sizeof(float));
+				map->gy = malloc(expected * sizeof(float));
+				if(map->gx == NULL || map->gy == NULL)
+				{
+					snprintf(err, errLen, "out of memory");
+					goto fail;
+				}
+			}
+			else
+			{
+				snprintf(err, errLen, "line %d is not a poly or grid header", lineNo);
+				goto fail;
+			}
+			continue;
+		}
+		if(map->type == POSMAP_POLY)
+		{
+			n = ParseFields(p, v, 4);
+			if(n != 4 || v[0] != (int)v[0] || v[1] != (int)v[1] || v[0] < 0 || v[1] < 0
+				|| v[0] + v[1] > map->order)
+			{
+				snprintf(err, errLen, "line %d needs i, j, cx, cy with i+j <= %d", lineNo, map->order);
+				goto fail;
+			}
+			if(rows >= expected)
+			{
+				snprintf(err, errLen, "more than %d terms", expected);
+				goto fail;
+			}
+			map->pi[rows] = (int)v[0];
+			map->pj[rows] = (int)v[1];
+			map->cx[rows] = v[2];
+			map->cy[rows] = v[3];
+		}
+		else
+		{
+			if(ParseFields(p, v, 2) != 2)
+			{
+				snprintf(err, errLen, "line %d needs x, y", lineNo);
+				goto fail;
+			}
+			if(rows >= expected)
+			{
+				snprintf(err, errLen, "more than %d nodes", expected);
+				goto fail;
+			}
+			map->gx[rows] = v[0];
+			map->gy[rows] = v[1];
+		}
+		rows++;
+	}
+	fclose(fp);
+	fp = NULL;
+	if(map == NULL)
+	{
+		snprintf(err, errLen, "no header");
+		return NULL;
+	}
+	if(map->type == POSMAP_GRID && rows != expected)
+	{
+		snprintf(err, errLen, "%d nodes, expected %d", rows, expected);
+		goto fail;
+	}
+	if(map->type == POSMAP_POLY && rows == 0)
+	{
+		snprintf(err, errLen, "no terms");
+		goto fail;
+	}
+	map->terms = rows;
+	return map;
+
+fail:
+	if(fp != NULL)
+		fclose(fp);
+	FreeMap(map);
+	return NULL;
+}
+
+/* Comma separated numbers, a leading comma is allowed after a header word.
+   Returns the count, or -1 if a field is not a number or there are more
+   than maxValues. */
+static int ParseFields(char *line, double *values, int maxValues)
+{
+	char *field, *next, *end;
+	int n = 0;
+	line += strspn(line, " \t");
+	if(*line == ',')
+		line++;
+	for(field=line; field!=NULL; field=next)
+	{
+		next = strchr(field, ',');
+		if(next != NULL)
+			*next++ = '\0';
+		if(n >= maxValues)
+			return -1;
+		field += strspn(field, " \t");
+		values[n] = strtod(field, &end);
+		if(end == field)
+			return -1;
+		end += strspn(end, " \t");
+		if(*end != '\0' || !isfinite(values[n]))
+			return -1;
+		n++;
+	}
+	return n;
+}
+
+static void PublishMap(int bpm, posMap_t *map)
+{
+	posMap_t *old;
+	pthread_mutex_lock(&mapLock);
+	old = maps[bpm];
+	maps[bpm] = map;
+	pthread_mutex_unlock(&mapLock);
+	FreeMap(old);
+}
+
+static void FreeMap(posMap_t *map)
+{
+	if(map == NULL)
+		return;
+	free(map->gx);
+	free(map->gy);
+	free(map);
+}
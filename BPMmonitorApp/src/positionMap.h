@@ -0,0 +1,27 @@
+/* positionMap.h */
+/* Author:  Gao    Create Date:  19Oct2026 */
+/* The last modified date:  19Oct2026 */
+
+#ifndef _positionMap_H
+#define _positionMap_H
+
+#define pos_map_bpm_num 2
+
+#define POSMAP_NONE 0
+#define POSMAP_POLY 1
+#define POSMAP_GRID 2
+
+/* The following functions will be called from driver layer.**************/
+int PosMapLoad(int bpm, const char *path);
+
+void PosMapClear(int bpm);
+
+void PosMapEnable(int bpm, int enable);
+
+int PosMapType(int bpm);
+
+int PosMapEnabled(int bpm);
+
+int PosMapApply(int bpm, float *x, float *y, int length);
+
+#endif
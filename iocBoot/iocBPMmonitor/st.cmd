@@ -5,12 +5,35 @@
 
 #< envPaths
 
+## $(P):TriggerFrame carries a whole trigger frame (880112 bytes)
+epicsEnvSet("EPICS_CA_MAX_ARRAY_BYTES", "1000000")
+
 ## Register all support components
 dbLoadDatabase("../../dbd/BPMmonitor.dbd",0,0)
 BPMmonitor_registerRecordDeviceDriver(pdbbase) 
 
+## Setpoint snapshot used for a warm start, "" disables it
+BPMSetSnapshotFile("/mnt/BPM_2bpmIn1Chassis_ioc/parameter/BPMsetpoints.snap")
+## Calibration CSV file, reloaded automatically when it changes
+BPMSetCalibrationFile("/mnt/BPM_2bpmIn1Chassis_ioc/parameter/llrfparameters.csv")
+## Driver log: level (0=debug,1=info,2=warning,3=error), lines per second per message, file ("" = console)
+BPMLogConfig(1, 10, "")
+## Real-time acquisition thread: policy (fifo, rr, other), priority, cpus, mlockall
+#BPMRealTime("fifo", 80, "1", 1)
+#BPMWorkerPool(2, 70, "2-3")
+#BPMPositionMap(1, "/mnt/BPM_2bpmIn1Chassis_ioc/parameter/bpm1_map.csv")
+#BPMPositionMap(2, "/mnt/BPM_2bpmIn1Chassis_ioc/parameter/bpm2_map.csv")
+## Raw ADC capture ring, pulses (1.28 MB each)
+#BPMADCCapture(8)
+## Record the hardware data and status to a file, frames (0 = no limit)
+#BPMRecord("/mnt/BPM_2bpmIn1Chassis_ioc/data/bpm.rec", 600)
+## Replay a recording instead of the hardware: speed (1 = recorded pace, 0 = as fast as possible), loop
+#BPMReplay("/mnt/BPM_2bpmIn1Chassis_ioc/data/bpm.rec", 1, 0)
+
 ## Load record instances
 dbLoadRecords("../../db/BPMMonitor.db","P=iLinac_007:BPM14And15, P1=iLinac_007:BPM14, P2=iLinac_007:BPM15")
+## Raw waveforms as integer counts instead of volts, scale in *CountSlope/*CountOffset
+#dbLoadRecords("../../db/BPMMonitor.db","P=iLinac_007:BPM14And15, P1=iLinac_007:BPM14, P2=iLinac_007:BPM15, ADC_FTVL=SHORT, TRIG_FTVL=LONG, HIST_FTVL=LONG")
 dbLoadRecords("../../db/BPMCal.db","P=iLinac_007:BPM14And15, P1=iLinac_007:BPM14, P2=iLinac_007:BPM15")
 
 iocInit()